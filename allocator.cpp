@@ -0,0 +1,240 @@
+#include "allocator.h"
+
+#include <stdio.h>
+
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "kernel.h"
+
+// Size classes run from 256 bytes to 1 GiB, larger blocks go straight to the
+// backend and back
+static const int MIN_CLASS = 8, MAX_CLASS = 30;
+// scratch allocations are aligned like cudaMalloc's
+static const size_t SCRATCH_ALIGN = 256;
+
+struct Block {
+    size_t size;    // as asked for
+    int sizeClass;  // -1 for blocks above MAX_CLASS
+};
+
+static std::mutex mutex;
+static std::vector<void *> freeLists[MAX_CLASS + 1];
+static std::unordered_map<void *, Block> blocks;
+static Allocator::Stats counters;
+// bumped by trim(), arenas of other threads see it at their next endFrame()
+static std::atomic<unsigned> trims(0);
+
+// A frame arena, and what did not fit in it this frame. Every thread that
+// projects frames gets its own, which only that thread touches.
+struct Arena {
+    char *base;
+    size_t capacity, used, demand;
+    unsigned trimmed;  // the trims seen when it was last released
+    std::vector<void *> overflow;
+
+    Arena();
+    ~Arena();
+    // gives the arena back to the pool, only between frames
+    void release();
+};
+
+static Arena &threadArena() {
+    static thread_local Arena arena;
+    return arena;
+}
+
+static int classOf(size_t size) {
+    int c = MIN_CLASS;
+    while (c <= MAX_CLASS && ((size_t)1 << c) < size) c++;
+    return c > MAX_CLASS ? -1 : c;
+}
+
+static size_t classSize(const Block &block) {
+    return block.sizeClass < 0 ? block.size : (size_t)1 << block.sizeClass;
+}
+
+static void *allocLocked(size_t size) {
+    Block block = {size, classOf(size)};
+    void *ptr = NULL;
+    if (block.sizeClass >= 0 && !freeLists[block.sizeClass].empty()) {
+        ptr = freeLists[block.sizeClass].back();
+        freeLists[block.sizeClass].pop_back();
+        counters.cached -= classSize(block);
+    } else {
+        ptr = GPU::deviceAlloc(classSize(block));
+        if (!ptr) {
+            printf("[Error] Device allocation of %zu bytes failed\n", size);
+            return NULL;
+        }
+        counters.reserved += classSize(block);
+        counters.backendAllocations++;
+    }
+    blocks[ptr] = block;
+    counters.allocations++;
+    counters.live += size;
+    counters.fragmented += classSize(block) - size;
+    if (counters.live > counters.peak) counters.peak = counters.live;
+    return ptr;
+}
+
+static void freeLocked(void *ptr) {
+    auto it = blocks.find(ptr);
+    if (it == blocks.end()) {
+        printf("[Error] Freeing %p, which the allocator never handed out\n",
+               ptr);
+        return;
+    }
+    const Block block = it->second;
+    blocks.erase(it);
+    counters.live -= block.size;
+    counters.fragmented -= classSize(block) - block.size;
+    if (block.sizeClass < 0) {
+        GPU::deviceFree(ptr);
+        counters.reserved -= block.size;
+        return;
+    }
+    freeLists[block.sizeClass].push_back(ptr);
+    counters.cached += classSize(block);
+}
+
+void *Allocator::alloc(size_t size) {
+    std::lock_guard<std::mutex> lock(mutex);
+    return allocLocked(size);
+}
+
+void Allocator::free(void *ptr) {
+    if (!ptr) return;
+    std::lock_guard<std::mutex> lock(mutex);
+    freeLocked(ptr);
+}
+
+void *Allocator::realloc(void *ptr, size_t size) {
+    if (!ptr) return alloc(size);
+    size_t keep;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = blocks.find(ptr);
+        if (it == blocks.end()) {
+            printf("[Error] Reallocating %p, which the allocator never "
+                   "handed out\n",
+                   ptr);
+            return NULL;
+        }
+        Block &block = it->second;
+        if (block.sizeClass >= 0 && size <= classSize(block)) {
+            // still fits, nothing moves
+            counters.live += size - block.size;
+            counters.fragmented -= size - block.size;
+            if (counters.live > counters.peak) counters.peak = counters.live;
+            block.size = size;
+            return ptr;
+        }
+        keep = block.size < size ? block.size : size;
+    }
+    void *moved = alloc(size);
+    if (moved) GPU::deviceCopy(moved, ptr, keep);
+    free(ptr);
+    return moved;
+}
+
+Arena::Arena()
+    : base(NULL), capacity(0), used(0), demand(0), trimmed(trims.load()) {}
+
+Arena::~Arena() { release(); }
+
+void Arena::release() {
+    for (void *ptr : overflow) Allocator::free(ptr);
+    overflow.clear();
+    Allocator::free(base);
+    std::lock_guard<std::mutex> lock(mutex);
+    counters.scratch -= capacity;
+    base = NULL;
+    capacity = used = demand = 0;
+}
+
+void *Allocator::scratch(size_t size) {
+    Arena &arena = threadArena();
+    size = (size + SCRATCH_ALIGN - 1) / SCRATCH_ALIGN * SCRATCH_ALIGN;
+    arena.demand += size;
+    if (arena.used + size <= arena.capacity) {
+        void *ptr = arena.base + arena.used;
+        arena.used += size;
+        return ptr;
+    }
+    // the arena grows at endFrame, until then spill into the pool
+    void *ptr = alloc(size);
+    arena.overflow.push_back(ptr);
+    return ptr;
+}
+
+void Allocator::endFrame() {
+    Arena &arena = threadArena();
+    const unsigned seen = trims.load();
+    if (arena.trimmed != seen) {
+        // trimmed since the last frame, grow back when needed
+        arena.release();
+        arena.trimmed = seen;
+        return;
+    }
+    for (void *ptr : arena.overflow) free(ptr);
+    arena.overflow.clear();
+    if (arena.demand > arena.capacity) {
+        // enough for this frame in a single block from now on
+        free(arena.base);
+        size_t capacity = SCRATCH_ALIGN;
+        while (capacity < arena.demand) capacity *= 2;
+        arena.base = (char *)alloc(capacity);
+        const size_t old = arena.capacity;
+        arena.capacity = arena.base ? capacity : 0;
+        std::lock_guard<std::mutex> lock(mutex);
+        counters.scratch += arena.capacity - old;
+    }
+    arena.used = 0;
+    arena.demand = 0;
+}
+
+void Allocator::trim() {
+    // other threads may be in the middle of a frame, they give their arenas
+    // back at their next endFrame()
+    Arena &arena = threadArena();
+    arena.release();
+    arena.trimmed = ++trims;
+    std::lock_guard<std::mutex> lock(mutex);
+    for (int c = MIN_CLASS; c <= MAX_CLASS; c++) {
+        for (void *ptr : freeLists[c]) GPU::deviceFree(ptr);
+        counters.reserved -= freeLists[c].size() << c;
+        freeLists[c].clear();
+        freeLists[c].shrink_to_fit();
+    }
+    counters.cached = 0;
+}
+
+Allocator::Stats Allocator::stats() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return counters;
+}
+
+void *GPU::malloc(size_t size) { return Allocator::alloc(size); }
+
+void GPU::free(void *mem) { Allocator::free(mem); }
+
+void *GPU::realloc(void *ptr, size_t os, size_t ns) {
+    (void)os;
+    return Allocator::realloc(ptr, ns);
+}
+
+void Allocator::printStats() {
+    const Stats s = stats();
+    const double MB = 1024.0 * 1024.0;
+    printf("  %-20s %10.2f MB\n", "memory_live", s.live / MB);
+    printf("  %-20s %10.2f MB\n", "memory_peak", s.peak / MB);
+    printf("  %-20s %10.2f MB\n", "memory_reserved", s.reserved / MB);
+    printf("  %-20s %10.2f MB\n", "memory_cached", s.cached / MB);
+    printf("  %-20s %10.2f MB\n", "memory_fragmented", s.fragmented / MB);
+    printf("  %-20s %10.2f MB\n", "memory_scratch", s.scratch / MB);
+    printf("  %-20s %10zu (%zu from the backend)\n", "allocations",
+           s.allocations, s.backendAllocations);
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <stddef.h>
+
+// Pools device memory for the whole renderer, behind GPU::malloc, GPU::free
+// and GPU::realloc. Blocks are rounded up to power of two size classes and
+// recycled through one free list per class, so allocating and freeing are
+// O(1) and never reach the backend once the working set is warm. Memory only
+// goes back to the backend through trim().
+//
+// Memory that is only needed until the end of a frame comes from scratch(),
+// a bump arena that endFrame() resets in one go. Each thread has its own.
+struct Allocator {
+    struct Stats {
+        size_t live;        // bytes asked for by blocks in use
+        size_t peak;        // highest live seen
+        size_t reserved;    // bytes held from the backend, in use or not
+        size_t cached;      // reserved bytes sitting in the free lists
+        size_t fragmented;  // lost to rounding up to a size class
+        size_t scratch;     // capacity of the frame arena
+        size_t allocations, backendAllocations;
+    };
+
+    static void *alloc(size_t size);
+    static void free(void *ptr);
+    // Grows or shrinks ptr, in place when the new size fits its size class
+    static void *realloc(void *ptr, size_t size);
+
+    // Device memory that stays valid until the calling thread's next
+    // endFrame()
+    static void *scratch(size_t size);
+    // Resets the calling thread's frame arena, growing it when the frame
+    // needed more
+    static void endFrame();
+
+    // Gives every cached block and the calling thread's frame arena back to
+    // the backend. Only between the caller's frames, other threads give
+    // their arenas back to the pool at their next endFrame().
+    static void trim();
+
+    static Stats stats();
+    static void printStats();
+};
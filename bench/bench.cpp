@@ -0,0 +1,345 @@
+// Microbenchmarks of the vertex pipeline, for telling whether a change to
+// matrix.h or a backend helps or hurts. Times the matrix products the
+// pipeline runs, normalizeAndCutOff, loadObj of every obj file and a whole
+// screenProjection frame, and writes the results as JSON. With --compare,
+// every result is checked against a saved run and slower ones are flagged.
+//
+//   ./renderer-bench --out before.json
+//   ./renderer-bench --out after.json --compare before.json
+//
+// Options it does not know are handed to the Renderer, so obj files,
+// --instances and --no-lod work as they do for --headless.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "../allocator.h"
+#include "../renderer.h"
+#include "../threadpool.h"
+
+// every benchmark repeats until it ran for this long, and at least MIN_REPS
+// times
+static const Uint64 MIN_TIME = 250000000;  // ns
+static const int MIN_REPS = 5;
+// calls without a setup are batched until a rep takes this long, so that
+// the timer's own cost and resolution stay out of the result
+static const Uint64 MIN_REP_TIME = 100000;  // ns
+static const int MAX_BATCH = 1 << 20;
+// products per call of the 4x4 ones, too short to time one at a time
+static const int MAT4_BATCH = 10000, SQUARE_BATCH = 1000;
+// a median this much slower than the baseline is a regression, in percent
+static const double DEFAULT_THRESHOLD = 10;
+static const unsigned COLOR_SEED = 1;
+
+struct Result {
+    std::string name;
+    long items;  // rows, vertices or products a rep works through
+    int reps;
+    double minNs, medianNs;
+};
+
+struct Options {
+    const char *out = "bench.json";
+    const char *baseline = NULL;
+    const char *filter = NULL;
+    double threshold = DEFAULT_THRESHOLD;
+};
+
+// what a results file holds
+struct Run {
+    std::string precision;
+    int threads = 0;
+    std::vector<Result> results;
+};
+
+static Options options;
+static Run run;
+
+static const char *precision() {
+    return sizeof(real) == sizeof(float) ? "float" : "double";
+}
+
+// Times batch calls of fn per rep, after one untimed warm up call. setup
+// runs before every rep and is not timed, for benchmarks that change their
+// own input. Results are per call.
+template <typename S, typename F>
+static void measure(const std::string &name, long items, int batch, S setup,
+                    F fn) {
+    setup();
+    fn();
+    GPU::synchronize();
+    std::vector<Uint64> times;
+    Uint64 total = 0;
+    while ((int)times.size() < MIN_REPS || total < MIN_TIME) {
+        setup();
+        const Uint64 start = Profiler::now();
+        for (int i = 0; i < batch; i++) fn();
+        GPU::synchronize();
+        const Uint64 ns = Profiler::now() - start;
+        times.push_back(ns);
+        total += ns;
+    }
+    std::sort(times.begin(), times.end());
+    const Result r = {name, items, (int)times.size(),
+                      (double)times[0] / batch,
+                      (double)times[times.size() / 2] / batch};
+    printf("  %-40s %12.4f %12.4f %10.2f %6d\n", name.c_str(), r.minNs / 1e6,
+           r.medianNs / 1e6, r.medianNs / items, r.reps);
+    fflush(stdout);
+    run.results.push_back(r);
+}
+
+template <typename S, typename F>
+static void measure(const std::string &name, long items, S setup, F fn) {
+    if (options.filter && !strstr(name.c_str(), options.filter)) return;
+    measure(name, items, 1, setup, fn);
+}
+
+template <typename F>
+static void measure(const std::string &name, long items, F fn) {
+    if (options.filter && !strstr(name.c_str(), options.filter)) return;
+    // as many calls per rep as make it last MIN_REP_TIME
+    int batch = 1;
+    for (; batch < MAX_BATCH; batch *= 2) {
+        const Uint64 start = Profiler::now();
+        for (int i = 0; i < batch; i++) fn();
+        GPU::synchronize();
+        if (Profiler::now() - start >= MIN_REP_TIME) break;
+    }
+    measure(name, items, batch, [] {}, fn);
+}
+
+// rows of x, y, z in [-1.5, 1.5) and w in [0.5, 1.5), so that some of them
+// are cut off by normalizeAndCutOff
+static std::vector<real> randomRows(int rows) {
+    std::vector<real> host((size_t)rows * 4);
+    unsigned state = 12345;
+    auto next = [&] {
+        state = state * 1664525 + 1013904223;
+        return (real)(state >> 8) / (1 << 24);
+    };
+    for (int i = 0; i < rows; i++) {
+        for (int k = 0; k < 3; k++) host[i * 4 + k] = next() * 3 - 1.5;
+        host[i * 4 + 3] = next() + 0.5;
+    }
+    return host;
+}
+
+static void benchMatrices() {
+    const Mat4 view =
+        Transform::rotate_y(0.3) * Transform::translate({1, 2, 3});
+    Matrix right(4, 4);
+    right.assignRows(view.values, 4);
+
+    for (int rows = 1000; rows <= 10000000; rows *= 10) {
+        const std::vector<real> host = randomRows(rows);
+        Matrix left(rows, 4), out(rows, 4);
+        left.assignRows(host.data(), rows);
+        measure("multiply/" + std::to_string(rows) + "x4*4x4", rows, [&] {
+            Matrix::multiply(rows, 4, 4, left.values, right.values, out.values,
+                             true, true, true);
+        });
+        // cut off values stay cut off, so every rep starts from host again
+        measure(
+            "normalizeAndCutOff/" + std::to_string(rows) + "x4", rows,
+            [&] {
+                GPU::memcpy(out.values, (void *)host.data(),
+                            sizeof(real) * rows * 4);
+            },
+            [&] { out.normalizeAndCutoff(); });
+    }
+
+    // distinct operands for every product, so that no single placement of
+    // them in memory decides the result
+    std::vector<real> squares((size_t)SQUARE_BATCH * 16);
+    for (int i = 0; i < SQUARE_BATCH; i++) {
+        std::copy(view.values, view.values + 16, &squares[(size_t)i * 16]);
+    }
+    Matrix square(SQUARE_BATCH * 4, 4), product(SQUARE_BATCH * 4, 4);
+    square.assignRows(squares.data(), SQUARE_BATCH * 4);
+    measure("multiply/4x4*4x4", SQUARE_BATCH, [&] {
+        for (int i = 0; i < SQUARE_BATCH; i++) {
+            Matrix::multiply(4, 4, 4, &square.values[i * 16], right.values,
+                             &product.values[i * 16], true, true, true);
+        }
+    });
+    // the host product every instance's clip matrix is composed with
+    Mat4 sink = Mat4::identity();
+    measure("mat4/4x4*4x4", MAT4_BATCH, [&] {
+        for (int i = 0; i < MAT4_BATCH; i++) sink = sink * view;
+    });
+    volatile real keep = sink.at(0);  // or the loop is optimized away
+    (void)keep;
+}
+
+static bool readable(const char *file) {
+    FILE *f = fopen(file, "r");
+    if (f == NULL) return false;
+    fclose(f);
+    return true;
+}
+
+// loadObj with the mesh and level caches in place, and one projected frame
+// of each file
+static void benchFiles(Renderer &r) {
+    const std::vector<const char *> &given = r.objFiles;
+    std::vector<const char *> files(given.begin(), given.end());
+    if (files.empty()) files.assign(objectList, objectList + objectListSize);
+
+    for (const char *file : files) {
+        if (!readable(file)) {
+            printf("  %-40s skipped, cannot open it\n", file);
+            continue;
+        }
+        const std::string name = file;
+        measure("loadObj/" + name, 1, [&] {
+            Object3D loaded = Object3D::loadObj(file, &r, COLOR_SEED);
+        });
+
+        // scatter places the instances with rand()
+        srand(1);
+        r.show(Object3D::loadObj(file, &r, COLOR_SEED));
+        r.scene.prepare();
+        Object3D &mesh = r.scene.meshes[0];
+        measure("screenProjection/" + name, r.scene.vertexCount(), [&] {
+            mesh.screenProjection(0, false);
+            Allocator::endFrame();
+        });
+        r.scene.destroy();
+    }
+}
+
+static bool writeResults(const char *file) {
+    FILE *f = fopen(file, "w");
+    if (f == NULL) {
+        printf("[Error] Cannot write %s\n", file);
+        return false;
+    }
+    // one benchmark per line, which is all readResults() expects
+    const std::vector<Result> &results = run.results;
+    fprintf(f, "{\n  \"precision\": \"%s\",\n  \"threads\": %d,\n",
+            run.precision.c_str(), run.threads);
+    fprintf(f, "  \"benchmarks\": [\n");
+    for (size_t i = 0; i < results.size(); i++) {
+        const Result &r = results[i];
+        fprintf(f,
+                "    {\"name\": \"%s\", \"items\": %ld, \"reps\": %d, "
+                "\"min_ns\": %.0f, \"median_ns\": %.0f, \"ns_per_item\": "
+                "%.3f}%s\n",
+                r.name.c_str(), r.items, r.reps, r.minNs, r.medianNs,
+                r.medianNs / r.items, i + 1 < results.size() ? "," : "");
+    }
+    fprintf(f, "  ]\n}\n");
+    return fclose(f) == 0;
+}
+
+// Reads a file written by writeResults(), not JSON in general
+static bool readResults(const char *file, Run &read) {
+    FILE *f = fopen(file, "r");
+    if (f == NULL) {
+        printf("[Error] Cannot open baseline: %s\n", file);
+        return false;
+    }
+    char line[1024], name[512];
+    while (fgets(line, sizeof(line), f)) {
+        Result r;
+        if (sscanf(line, " \"precision\": \"%511[^\"]\"", name) == 1) {
+            read.precision = name;
+            continue;
+        }
+        if (sscanf(line, " \"threads\": %d", &read.threads) == 1) continue;
+        if (sscanf(line,
+                   " {\"name\": \"%511[^\"]\", \"items\": %ld, \"reps\": %d, "
+                   "\"min_ns\": %lf, \"median_ns\": %lf",
+                   name, &r.items, &r.reps, &r.minNs, &r.medianNs) == 5) {
+            r.name = name;
+            read.results.push_back(r);
+        }
+    }
+    fclose(f);
+    if (read.results.empty()) {
+        printf("[Error] No benchmarks in baseline: %s\n", file);
+        return false;
+    }
+    return true;
+}
+
+// Returns the number of benchmarks that got slower than the threshold
+// allows. Both the median and the fastest rep have to, as a busy machine
+// moves the median alone, while a slower build moves both.
+static int compare(const Run &before) {
+    printf("\ncompared to %s, regressions above %.0f%%:\n", options.baseline,
+           options.threshold);
+    if (before.precision != run.precision || before.threads != run.threads) {
+        printf("  the baseline ran in %s on %d threads, this in %s on %d\n",
+               before.precision.c_str(), before.threads, run.precision.c_str(),
+               run.threads);
+    }
+    const std::vector<Result> &baseline = before.results;
+    const std::vector<Result> &results = run.results;
+    printf("  %-40s %12s %12s %8s %8s\n", "benchmark", "before(ms)",
+           "after(ms)", "change", "min");
+    int regressions = 0;
+    for (const Result &now : results) {
+        auto before = std::find_if(
+            baseline.begin(), baseline.end(),
+            [&](const Result &b) { return b.name == now.name; });
+        if (before == baseline.end()) {
+            printf("  %-40s %12s %12.4f %8s\n", now.name.c_str(), "-",
+                   now.medianNs / 1e6, "new");
+            continue;
+        }
+        const double change = (now.medianNs / before->medianNs - 1) * 100;
+        const double minChange = (now.minNs / before->minNs - 1) * 100;
+        const bool slower =
+            change > options.threshold && minChange > options.threshold;
+        regressions += slower;
+        printf("  %-40s %12.4f %12.4f %+7.1f%% %+7.1f%%%s\n",
+               now.name.c_str(), before->medianNs / 1e6, now.medianNs / 1e6,
+               change, minChange, slower ? "  REGRESSION" : "");
+    }
+    printf("%d of %zu benchmarks regressed\n", regressions, results.size());
+    return regressions;
+}
+
+int main(int argc, char **argv) {
+    // what is not for the benchmarks goes to the renderer, which draws
+    // offscreen like --headless
+    std::vector<char *> rendererArgs = {argv[0], (char *)"--headless",
+                                        (char *)"1", (char *)"--still"};
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--out") == 0 && i + 1 < argc) {
+            options.out = argv[++i];
+        } else if (strcmp(argv[i], "--compare") == 0 && i + 1 < argc) {
+            options.baseline = argv[++i];
+        } else if (strcmp(argv[i], "--threshold") == 0 && i + 1 < argc) {
+            options.threshold = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+            options.filter = argv[++i];
+        } else {
+            rendererArgs.push_back(argv[i]);
+        }
+    }
+    Run baseline;
+    if (options.baseline && !readResults(options.baseline, baseline)) {
+        return 2;
+    }
+
+    Renderer r(rendererArgs.size(), rendererArgs.data());
+    run.precision = precision();
+    run.threads = ThreadPool::size();
+    printf("  %-40s %12s %12s %10s %6s\n", "benchmark", "min(ms)",
+           "median(ms)", "ns/item", "reps");
+    benchMatrices();
+    benchFiles(r);
+
+    if (!writeResults(options.out)) return 2;
+    printf("results written to %s\n", options.out);
+    if (options.baseline && compare(baseline) > 0) return 1;
+    return 0;
+}
@@ -7,11 +7,22 @@
 
 void Camera::init(Renderer *r, Point3D p) {
     position.fill(p.x, p.y, p.z, 1);
+    forward = Vec4(0, 0, 1, 1);
+    up = Vec4(0, 1, 0, 1);
+    right = Vec4(1, 0, 0, 1);
     renderer = r;
     v_fov = H_FOV * ((double)r->HEIGHT / (double)r->WIDTH);
+    version++;
 }
 
 void Camera::control(const bool *keys) {
+    static const int moves[] = {SDLK_a, SDLK_d, SDLK_w, SDLK_s, SDLK_q, SDLK_e};
+    for (int key : moves) {
+        if (keys[key]) {
+            version++;
+            break;
+        }
+    }
     if (keys[SDLK_a]) {
         position.multiply_sub(right, MOVING_SPEED);
     }
@@ -54,6 +65,7 @@ void Camera::cameraYaw(double angle) {
     forward = forward * rotate;
     right = right * rotate;
     up = up * rotate;
+    version++;
 }
 
 void Camera::cameraPitch(double angle) {
@@ -61,4 +73,5 @@ void Camera::cameraPitch(double angle) {
     forward = forward * rotate;
     right = right * rotate;
     up = up * rotate;
+    version++;
 }
@@ -0,0 +1,195 @@
+#include "culler.h"
+
+#include <limits.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "profiler.h"
+#include "threadpool.h"
+
+// faces per chunk handed to a worker
+static const int FACE_GRAIN = 2048;
+
+void Culler::init(int w, int h, double near, double far) {
+    width = w;
+    height = h;
+    nearPlane = near;
+    farPlane = far;
+}
+
+// A vertex in clip space, rebuilt from the transform output
+struct ClipVertex {
+    double x, y, z, w;
+};
+
+static Uint8 lerpChannel(Uint8 a, Uint8 b, double t) {
+    return (Uint8)(a + (b - a) * t + 0.5);
+}
+
+void Culler::cullRange(int begin, int end, const float *w, const int *faces,
+                       int faceCount, int vertexCount,
+                       const SDL_Vertex *vertices, const float *depths,
+                       Chunk &out) const {
+    const double hw = width / 2, hh = height / 2;
+    out.indices.clear();
+    out.extraVertices.clear();
+    out.extraDepths.clear();
+
+    for (int i = begin; i < end; i++) {
+        // i runs over the faces of every instance in turn
+        const int instance = i / faceCount;
+        const int *meshFace = &faces[(i - instance * faceCount) * 3];
+        const int offset = instance * vertexCount;
+        const int face[3] = {meshFace[0] + offset, meshFace[1] + offset,
+                             meshFace[2] + offset};
+        double v[3][4];
+        for (int k = 0; k < 3; k++) {
+            const SDL_FPoint &p = vertices[face[k]].position;
+            v[k][0] = p.x;
+            v[k][1] = p.y;
+            v[k][2] = depths[face[k]];
+            v[k][3] = w[face[k]];
+        }
+
+        int behind = 0, beyond = 0;
+        for (int k = 0; k < 3; k++) {
+            behind += v[k][3] < nearPlane;
+            beyond += v[k][3] > farPlane;
+        }
+        if (behind == 3 || beyond == 3) continue;
+
+        // screen position and index of the face, or of its clipped polygon
+        double sx[4], sy[4];
+        int id[4];
+        int n = 0;
+        if (behind == 0) {
+            for (int k = 0; k < 3; k++) {
+                sx[k] = v[k][0];
+                sy[k] = v[k][1];
+                id[k] = face[k];
+            }
+            n = 3;
+        } else {
+            // undo the divide, clip against w = near and project again
+            ClipVertex c[3];
+            for (int k = 0; k < 3; k++) {
+                const double cw = v[k][3];
+                c[k] = {(v[k][0] - hw) / hw * cw, (hh - v[k][1]) / hh * cw,
+                        v[k][2] * cw, cw};
+            }
+            for (int k = 0; k < 3; k++) {
+                int kb = (k + 1) % 3;
+                const ClipVertex &a = c[k], &b = c[kb];
+                bool aIn = a.w >= nearPlane, bIn = b.w >= nearPlane;
+                if (aIn) {
+                    sx[n] = v[k][0];
+                    sy[n] = v[k][1];
+                    id[n++] = face[k];
+                }
+                if (aIn == bIn) continue;
+                double t = (nearPlane - a.w) / (b.w - a.w);
+                double x = (a.x + (b.x - a.x) * t) / nearPlane;
+                double y = (a.y + (b.y - a.y) * t) / nearPlane;
+                double z = (a.z + (b.z - a.z) * t) / nearPlane;
+                const SDL_Color &ca = vertices[face[k]].color;
+                const SDL_Color &cb = vertices[face[kb]].color;
+                SDL_Vertex extra;
+                extra.position = {(float)(hw + hw * x), (float)(hh - hh * y)};
+                extra.color = {lerpChannel(ca.r, cb.r, t),
+                               lerpChannel(ca.g, cb.g, t),
+                               lerpChannel(ca.b, cb.b, t), 255};
+                extra.tex_coord = {1.0, 1.0};
+                sx[n] = extra.position.x;
+                sy[n] = extra.position.y;
+                id[n++] = ~(int)out.extraVertices.size();
+                out.extraVertices.push_back(extra);
+                out.extraDepths.push_back((float)z);
+            }
+        }
+
+        // fan the polygon, a clipped face gives at most two triangles
+        for (int k = 1; k + 1 < n; k++) {
+            const int idx[3] = {0, k, k + 1};
+            double x[3], y[3];
+            for (int j = 0; j < 3; j++) {
+                x[j] = sx[idx[j]];
+                y[j] = sy[idx[j]];
+            }
+
+            if ((x[0] < 0 && x[1] < 0 && x[2] < 0) ||
+                (x[0] > width && x[1] > width && x[2] > width) ||
+                (y[0] < 0 && y[1] < 0 && y[2] < 0) ||
+                (y[0] > height && y[1] > height && y[2] > height)) {
+                continue;
+            }
+
+            // positive for faces wound counter clockwise towards the camera,
+            // screen y grows downwards
+            double area =
+                (x[1] - x[0]) * (y[2] - y[0]) - (x[2] - x[0]) * (y[1] - y[0]);
+            if (area == 0 || isnan(area)) continue;
+            if (mode == CULL_BACK && area < 0) continue;
+            if (mode == CULL_FRONT && area > 0) continue;
+
+            // slivers that miss every pixel centre would draw nothing
+            double minX = fmin(x[0], fmin(x[1], x[2]));
+            double maxX = fmax(x[0], fmax(x[1], x[2]));
+            double minY = fmin(y[0], fmin(y[1], y[2]));
+            double maxY = fmax(y[0], fmax(y[1], y[2]));
+            if (ceil(minX - 0.5) > floor(maxX - 0.5) ||
+                ceil(minY - 0.5) > floor(maxY - 0.5)) {
+                continue;
+            }
+
+            for (int j = 0; j < 3; j++) out.indices.push_back(id[idx[j]]);
+        }
+    }
+}
+
+int Culler::run(const float *w, const int *faces, int faceCount,
+                int vertexCount, int instances, SDL_Vertex *vertices,
+                float *depths, int *indices, int *extraCount) {
+    PROFILE_SCOPE("cull");
+    // indices and extra vertices count in int, as SDL does, see
+    // Object3D::maxInstances()
+    const size_t faceTotal = (size_t)faceCount * instances;
+    const size_t vertexTotal =
+        ((size_t)vertexCount + (size_t)faceCount * 2) * instances;
+    if (faceTotal * 6 > INT_MAX || vertexTotal > INT_MAX) {
+        printf("[Error] Cannot cull %d instances of %d faces\n", instances,
+               faceCount);
+        *extraCount = 0;
+        return 0;
+    }
+    const int totalFaces = faceTotal;
+    int chunkCount = (totalFaces + FACE_GRAIN - 1) / FACE_GRAIN;
+    if ((int)chunks.size() < chunkCount) chunks.resize(chunkCount);
+
+    ThreadPool::parallel_for(chunkCount, 1, [&](int begin, int end) {
+        for (int chunk = begin; chunk < end; chunk++) {
+            int first = chunk * FACE_GRAIN;
+            int last = first + FACE_GRAIN < totalFaces ? first + FACE_GRAIN
+                                                       : totalFaces;
+            cullRange(first, last, w, faces, faceCount, vertexCount, vertices,
+                      depths, chunks[chunk]);
+        }
+    });
+
+    // compact the chunks in face order, so the submission order is stable
+    int count = 0, extras = 0;
+    for (int chunk = 0; chunk < chunkCount; chunk++) {
+        const Chunk &c = chunks[chunk];
+        const size_t base = (size_t)vertexCount * instances + extras;
+        for (int index : c.indices) {
+            indices[count++] = index < 0 ? (int)base + ~index : index;
+        }
+        size_t n = c.extraVertices.size();
+        if (n == 0) continue;
+        memcpy(&vertices[base], c.extraVertices.data(), sizeof(SDL_Vertex) * n);
+        memcpy(&depths[base], c.extraDepths.data(), sizeof(float) * n);
+        extras += n;
+    }
+    *extraCount = extras;
+    return count;
+}
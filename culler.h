@@ -0,0 +1,49 @@
+#pragma once
+
+#include <SDL2/SDL.h>
+
+#include <vector>
+
+#include "kernel.h"
+
+// Decides which triangles of an object are worth submitting. Works on the
+// output of GPU::transform (screen positions, depths and clip w, see
+// ScreenOutput) and, in parallel over the faces:
+//  - rejects faces entirely behind the near plane or beyond the far plane,
+//  - clips faces that cross the near plane in clip space,
+//  - rejects faces entirely off one side of the screen,
+//  - culls back (or front) faces by their screen space winding,
+//  - drops zero area faces and faces that cover no pixel centre.
+struct Culler {
+    enum Mode { CULL_NONE, CULL_BACK, CULL_FRONT };
+
+    Mode mode;
+    float width, height;
+    double nearPlane, farPlane;
+
+    Culler() : mode(CULL_BACK) {}
+    void init(int w, int h, double near, double far);
+
+    // Writes three indices per surviving triangle and returns how many were
+    // written. The mesh is drawn once per instance, instance k using the
+    // vertexCount vertices from k * vertexCount on, whose positions, colours,
+    // depths and clip space w must already be up to date. Clipping adds new
+    // vertices after all of them, up to faceCount * instances * 2, and
+    // *extraCount tells how many. The index list must hold
+    // faceCount * instances * 6.
+    int run(const float *w, const int *faces, int faceCount, int vertexCount,
+            int instances, SDL_Vertex *vertices, float *depths, int *indices,
+            int *extraCount);
+
+   private:
+    struct Chunk {
+        std::vector<int> indices;  // clipped vertices are stored as ~k
+        std::vector<SDL_Vertex> extraVertices;
+        std::vector<float> extraDepths;
+    };
+    std::vector<Chunk> chunks;
+
+    void cullRange(int begin, int end, const float *w, const int *faces,
+                   int faceCount, int vertexCount, const SDL_Vertex *vertices,
+                   const float *depths, Chunk &out) const;
+};
@@ -1,55 +1,58 @@
+#include <climits>
 #include <cublas_v2.h>
 #include <cuda.h>
 #include <cuda_runtime.h>
 
 #include "matrix.h"
 
-GPU::Buffer *buffers = NULL;
-
 cublasHandle_t BLAShandle = NULL;
 
 void GPU::init() {
     cublasCreate(&BLAShandle);
 }
 
-GPU::Buffer* GPU::Buffer::alloc(size_t size) {
-    GPU::Buffer **buff = &buffers;
-    while (*buff) {
-        GPU::Buffer *buffer = *buff;
-        if (!buffer->inuse && buffer->dim == size) {
-            buffer->inuse = true;
-            return buffer;
-        }
-        buff = &(buffer->next);
-    }
+void GPU::synchronize() { cudaDeviceSynchronize(); }
 
-    GPU::Buffer *nbuff = (GPU::Buffer *)std::malloc(sizeof(GPU::Buffer));
-    nbuff->dim = size;
-    nbuff->inuse = true;
-    cudaMalloc((void**)&nbuff->values, sizeof(double) * size);
-    nbuff->next = NULL;
-    *buff = nbuff;
-    return nbuff;
+// a pooled device copy of host values, handed back with GPU::free
+template <typename T>
+T *upload(const size_t dim, const T *values) {
+    T *buff = (T *)GPU::malloc(sizeof(T) * dim);
+    cudaMemcpy(buff, values, sizeof(T) * dim, cudaMemcpyHostToDevice);
+    Profiler::count(Profiler::BYTES_TO_DEVICE, sizeof(T) * dim);
+    return buff;
 }
 
-void GPU::Buffer::free() {
-    inuse = false;
+// cuBLAS names its routines by precision
+static void gemm(int m, int n, int k, const double *alpha, const double *a,
+                 int lda, const double *b, int ldb, const double *beta,
+                 double *c, int ldc) {
+    cublasDgemm(BLAShandle, CUBLAS_OP_N, CUBLAS_OP_N, m, n, k, alpha, a, lda,
+                b, ldb, beta, c, ldc);
 }
 
-GPU::Buffer *getBuffer(const size_t dim, const double *values) {
-    GPU::Buffer* buff = GPU::Buffer::alloc(dim);
-    cudaMemcpy(buff->values, values, sizeof(double) * dim,
-               cudaMemcpyHostToDevice);
-    return buff;
+static void gemm(int m, int n, int k, const float *alpha, const float *a,
+                 int lda, const float *b, int ldb, const float *beta, float *c,
+                 int ldc) {
+    cublasSgemm(BLAShandle, CUBLAS_OP_N, CUBLAS_OP_N, m, n, k, alpha, a, lda,
+                b, ldb, beta, c, ldc);
 }
 
+static void axpy(int n, const double *x, const double *a, double *b) {
+    cublasDaxpy(BLAShandle, n, x, a, 1, b, 1);
+}
+
+static void axpy(int n, const float *x, const float *a, float *b) {
+    cublasSaxpy(BLAShandle, n, x, a, 1, b, 1);
+}
+
+template <typename T>
 __global__ void cudaMultiply(const int rowsA, const int colsA, const int colsB,
-                             const double *a, const double *b, double *c) {
+                             const T *a, const T *b, T *c) {
     int row = blockIdx.y * blockDim.y + threadIdx.y;
     int col = blockIdx.x * blockDim.x + threadIdx.x;
 
     if (row < rowsA && col < colsB) {
-        double value = 0;
+        T value = 0;
         for (int k = 0; k < colsA; ++k) {
             value += a[row * colsA + k] * b[k * colsB + col];
         }
@@ -57,26 +60,27 @@ __global__ void cudaMultiply(const int rowsA, const int colsA, const int colsB,
     }
 }
 
-void GPU::multiply(const int row1, const int col1, const int col2,
-                   const double *v1, const double *v2, double *out,
-                   bool v1OnGpu, bool v2OnGpu, bool outOnGpu) {
-    GPU::Buffer *m1buffer = NULL, *m2buffer = NULL, *outbuffer = NULL;
+template <typename T>
+void GPU::multiply(const int row1, const int col1, const int col2, const T *v1,
+                   const T *v2, T *out, bool v1OnGpu, bool v2OnGpu,
+                   bool outOnGpu) {
+    T *m1buffer = NULL, *m2buffer = NULL, *outbuffer = NULL;
 
-    double *newout = out;
+    T *newout = out;
 
     if (!v1OnGpu) {
-        m1buffer = getBuffer(row1 * col1, v1);
-        v1 = m1buffer->values;
+        m1buffer = upload(row1 * col1, v1);
+        v1 = m1buffer;
     }
 
     if (!v2OnGpu) {
-        m2buffer = getBuffer(col1 * col2, v2);
-        v2 = m2buffer->values;
+        m2buffer = upload(col1 * col2, v2);
+        v2 = m2buffer;
     }
 
     if (!outOnGpu) {
-        outbuffer = getBuffer(row1 * col2, out);
-        newout = outbuffer->values;
+        outbuffer = upload(row1 * col2, out);
+        newout = outbuffer;
     }
 
     dim3 dimBlock(16, 64);
@@ -86,21 +90,22 @@ void GPU::multiply(const int row1, const int col1, const int col2,
     // cudaMultiply<<<dimGrid, dimBlock>>>(row1, col1, col2, v1,
     //                        v2, newout);
 
-    const double alpha = 1.0f, beta = 0.0f;
-    cublasDgemm(BLAShandle, CUBLAS_OP_N, CUBLAS_OP_N, col1, row1, col2, &alpha, v2,
-                    col1, v1, col2, &beta, newout, col1);
+    const T alpha = 1.0f, beta = 0.0f;
+    gemm(col1, row1, col2, &alpha, v2, col1, v1, col2, &beta, newout, col1);
 
     if (!outOnGpu) {
-        cudaMemcpy(out, newout, sizeof(double) * row1 * col2,
+        cudaMemcpy(out, newout, sizeof(T) * row1 * col2,
                    cudaMemcpyDeviceToHost);
+        Profiler::count(Profiler::BYTES_FROM_DEVICE, sizeof(T) * row1 * col2);
     }
 
-    if (m1buffer) m1buffer->inuse = false;
-    if (m2buffer) m2buffer->inuse = false;
-    if (outbuffer) outbuffer->inuse = false;
+    GPU::free(m1buffer);
+    GPU::free(m2buffer);
+    GPU::free(outbuffer);
 }
 
-__global__ void cudaNormalize(double *values, int n) {
+template <typename T>
+__global__ void cudaNormalize(T *values, int n) {
     int idx = blockIdx.x * blockDim.x + threadIdx.x;
 
     if (idx < n) {
@@ -112,7 +117,8 @@ __global__ void cudaNormalize(double *values, int n) {
     }
 }
 
-__global__ void cudaCutOff(double *values, int n) {
+template <typename T>
+__global__ void cudaCutOff(T *values, int n) {
     int idx = blockIdx.x * blockDim.x + threadIdx.x;
 
     if (idx < n) {
@@ -122,13 +128,14 @@ __global__ void cudaCutOff(double *values, int n) {
     }
 }
 
-void GPU::normalizeAndCutOff(int row1, int col1, double *mat, bool onGpu) {
-    GPU::Buffer *buffer = NULL;
-    double *newmat = mat;
+template <typename T>
+void GPU::normalizeAndCutOff(int row1, int col1, T *mat, bool onGpu) {
+    T *buffer = NULL;
+    T *newmat = mat;
 
     if (!onGpu) {
-        buffer = getBuffer(row1 * col1, mat);
-        newmat = buffer->values;
+        buffer = upload(row1 * col1, mat);
+        newmat = buffer;
     }
 
     int threadsPerBlock = 512;
@@ -138,40 +145,159 @@ void GPU::normalizeAndCutOff(int row1, int col1, double *mat, bool onGpu) {
     cudaCutOff<<<numBlocks, threadsPerBlock>>>(newmat, row1 * col1);
 
     if (!onGpu) {
-        cudaMemcpy(mat, newmat, sizeof(double) * row1 * col1,
+        cudaMemcpy(mat, newmat, sizeof(T) * row1 * col1,
                    cudaMemcpyDeviceToHost);
+        Profiler::count(Profiler::BYTES_FROM_DEVICE, sizeof(T) * row1 * col1);
 
-        buffer->inuse = false;
+        GPU::free(buffer);
     }
 }
 
-void GPU::multiply_add(double *b, const double *a, double x, int size) {
+template <typename T>
+__global__ void cudaTransform(int n, int blocksPerInstance,
+                              const T *__restrict__ in,
+                              const T *__restrict__ clips,
+                              const T *__restrict__ screen,
+                              float2 *__restrict__ xy,
+                              float *__restrict__ depth,
+                              float *__restrict__ w) {
+    // a run of blocksPerInstance blocks per instance, in one flat grid as
+    // the y dimension is capped at 65535
+    const size_t instance = blockIdx.x / blocksPerInstance;
+    __shared__ T c[16], s[16];
+    if (threadIdx.x < 16) {
+        c[threadIdx.x] = clips[instance * 16 + threadIdx.x];
+        s[threadIdx.x] = screen[threadIdx.x];
+    }
+    __syncthreads();
+
+    int idx = (blockIdx.x % blocksPerInstance) * blockDim.x + threadIdx.x;
+    if (idx >= n) return;
+
+    // planes keep the loads and stores of neighbouring threads coalesced
+    T x = in[idx], y = in[n + idx], z = in[2 * n + idx];
+    T p[4];
+    for (int j = 0; j < 4; j++) {
+        p[j] = x * c[j] + y * c[4 + j] + z * c[8 + j] + c[12 + j];
+    }
+    // no cutoff here, faces crossing the near plane are clipped later
+    T pw = p[3];
+    if (fabs(pw) < (T)1e-12) pw = pw < 0 ? (T)-1e-12 : (T)1e-12;
+    T inv = 1 / pw;
+    T nx = p[0] * inv, ny = p[1] * inv, nz = p[2] * inv;
+    T sv[3];
+    for (int j = 0; j < 3; j++) {
+        sv[j] = nx * s[j] + ny * s[4 + j] + nz * s[8 + j] + s[12 + j];
+    }
+    size_t o = instance * n + idx;
+    xy[o] = make_float2((float)sv[0], (float)sv[1]);
+    if (depth) depth[o] = (float)sv[2];
+    w[o] = (float)pw;
+}
+
+template <typename T>
+void GPU::transform(int count, int instances, const T *in, const T *clips,
+                    const T *screen, const ScreenOutput &out) {
+    const size_t total = (size_t)count * instances;
+    // the kernel cannot reach the host arrays, so the output is staged on
+    // the device as compactly as it lands there, x and y pairs, then w and
+    // depth planes, and copied over once it is done
+    const int floats = out.depth ? 4 : 3;
+    float *staged = (float *)GPU::malloc(sizeof(float) * floats * total);
+    float2 *xy = (float2 *)staged;
+    float *w = staged + 2 * total;
+    float *depth = out.depth ? w + total : NULL;
+
+    int threadsPerBlock = 256;
+    int blocksPerInstance = (count + threadsPerBlock - 1) / threadsPerBlock;
+    size_t numBlocks = (size_t)blocksPerInstance * instances;
+    cudaError_t error = numBlocks > INT_MAX ? cudaErrorInvalidConfiguration
+                                            : cudaSuccess;
+    if (error == cudaSuccess && numBlocks > 0) {
+        cudaTransform<<<(unsigned)numBlocks, threadsPerBlock>>>(
+            count, blocksPerInstance, in, clips, screen, xy, depth, w);
+        error = cudaGetLastError();
+    }
+    if (error != cudaSuccess) {
+        printf("[Error] Cannot transform %d instances of %d vertices: %s\n",
+               instances, count, cudaGetErrorString(error));
+        GPU::free(staged);
+        return;
+    }
+
+    // the pairs go straight into place between the rest of each vertex
+    cudaMemcpy2D(out.xy, sizeof(float) * out.xyStride, xy, sizeof(float2),
+                 sizeof(float2), total, cudaMemcpyDeviceToHost);
+    cudaMemcpy(out.w, w, sizeof(float) * total, cudaMemcpyDeviceToHost);
+    if (depth) {
+        cudaMemcpy(out.depth, depth, sizeof(float) * total,
+                   cudaMemcpyDeviceToHost);
+    }
+    Profiler::count(Profiler::BYTES_FROM_DEVICE,
+                    sizeof(float) * floats * total);
+    GPU::free(staged);
+}
+
+template <typename T>
+__global__ void cudaTransformPoints(int n, T *__restrict__ xyz,
+                                    const T *__restrict__ mat) {
+    __shared__ T m[16];
+    if (threadIdx.x < 16) m[threadIdx.x] = mat[threadIdx.x];
+    __syncthreads();
+
+    int idx = blockIdx.x * blockDim.x + threadIdx.x;
+    if (idx >= n) return;
+
+    T x = xyz[idx], y = xyz[n + idx], z = xyz[2 * n + idx];
+    for (int j = 0; j < 3; j++) {
+        xyz[j * n + idx] = x * m[j] + y * m[4 + j] + z * m[8 + j] + m[12 + j];
+    }
+}
+
+template <typename T>
+void GPU::transformPoints(int count, T *xyz, const T *mat) {
+    int threadsPerBlock = 256;
+    int numBlocks = (count + threadsPerBlock - 1) / threadsPerBlock;
+    cudaTransformPoints<<<numBlocks, threadsPerBlock>>>(count, xyz, mat);
+}
+
+template <typename T>
+void GPU::multiply_add(T *b, const T *a, T x, int size) {
 
     // Perform the operation b[i] += a[i] * x using cuBLAS
-    cublasDaxpy(BLAShandle, size, &x, a, 1, b, 1);
+    axpy(size, &x, a, b);
 }
 
-void *GPU::malloc(size_t size) {
+#define INSTANTIATE(T)                                                       \
+    template void GPU::multiply(const int, const int, const int, const T *, \
+                                const T *, T *, bool, bool, bool);           \
+    template void GPU::normalizeAndCutOff(int, int, T *, bool);              \
+    template void GPU::transform(int, int, const T *, const T *, const T *,  \
+                                 const ScreenOutput &);                      \
+    template void GPU::transformPoints(int, T *, const T *);                 \
+    template void GPU::multiply_add(T *, const T *, T, int);
+
+INSTANTIATE(float)
+INSTANTIATE(double)
+
+void *GPU::deviceAlloc(size_t size) {
     void *ret;
-    cudaMalloc(&ret, size);
+    if (cudaMalloc(&ret, size) != cudaSuccess) return NULL;
     return ret;
 }
 
-void GPU::free(void *mem) { cudaFree(mem); }
+void GPU::deviceFree(void *mem) { cudaFree(mem); }
+
+void GPU::deviceCopy(void *dst, const void *src, size_t size) {
+    cudaMemcpy(dst, src, size, cudaMemcpyDeviceToDevice);
+}
 
 void GPU::memcpy(void *dst, void *src, size_t siz, bool reverse) {
     if (reverse) {
         cudaMemcpy(dst, src, siz, cudaMemcpyDeviceToHost);
+        Profiler::count(Profiler::BYTES_FROM_DEVICE, siz);
     } else {
         cudaMemcpy(dst, src, siz, cudaMemcpyHostToDevice);
+        Profiler::count(Profiler::BYTES_TO_DEVICE, siz);
     }
 }
-
-void *GPU::realloc(void *ptr, size_t os, size_t ns) {
-    void *newPtr;
-    cudaMalloc(&newPtr, ns);
-    size_t lt = ns < os ? ns : os;
-    cudaMemcpy(newPtr, ptr, lt, cudaMemcpyDeviceToDevice);
-    cudaFree(ptr);
-    return newPtr;
-}
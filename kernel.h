@@ -1,30 +1,70 @@
 #pragma once
 
 #include <math.h>
+#include <stddef.h>
 
-struct GPU {
-    struct Buffer {
-        size_t dim;
-        double *values;
-        bool inuse;
-        Buffer *next;
+// Scalar type of the vertex pipeline. float halves the memory and bandwidth
+// of every vertex buffer, build with PRECISION=double (-DREAL_DOUBLE) for
+// precision sensitive work.
+#ifdef REAL_DOUBLE
+typedef double real;
+#else
+typedef float real;
+#endif
 
-        static Buffer *alloc(size_t size);
-        void free();
-    };
+// Where GPU::transform leaves vertex i: screen x and y as the floats at
+// xy + i * xyStride, which is where an SDL_Vertex array keeps its positions,
+// the NDC z at depth[i] unless depth is NULL, and the clip space w, which
+// Culler needs for near plane clipping, at w[i]. All in host memory, ready
+// to be culled and drawn. The CPU backend writes them in place, CUDA stages
+// them on the device and copies them over.
+struct ScreenOutput {
+    float *xy;
+    int xyStride;  // in floats
+    float *depth;
+    float *w;
+};
 
+// The compute entry points are instantiated for float and double
+struct GPU {
     static void init();
+    // Waits for all queued device work, so host timers see its real cost
+    static void synchronize();
 
+    // Device memory, pooled by Allocator
     static void *malloc(size_t size);
     static void *realloc(void *ptr, size_t os, size_t ns);
     static void memcpy(void *dst, void *src, size_t size, bool reverse = false);
     static void free(void *mem);
 
+    // What the backend provides to Allocator, nothing else calls these
+    static void *deviceAlloc(size_t size);
+    static void deviceFree(void *mem);
+    static void deviceCopy(void *dst, const void *src, size_t size);
+
+    template <typename T>
     static void multiply(const int row1, const int col1, const int col2,
-                         const double *v1, const double *v2, double *out,
-                         bool leftOnGpu, bool rightOnGpu, bool resultOnGpu);
+                         const T *v1, const T *v2, T *out, bool leftOnGpu,
+                         bool rightOnGpu, bool resultOnGpu);
+
+    template <typename T>
+    static void normalizeAndCutOff(int row, int col, T *mat, bool onGpu);
+
+    // The whole vertex pipeline in one pass over count vertices stored as
+    // x, y and z planes (see VertexArray), with w = 1, for every instance:
+    // in * clips[k], divided by w, then * screen, written to out as vertex
+    // k * count + i. clips holds one 4x4 per instance. in, clips and screen
+    // are on the GPU, out is not.
+    template <typename T>
+    static void transform(int count, int instances, const T *in,
+                          const T *clips, const T *screen,
+                          const ScreenOutput &out);
 
-    static void normalizeAndCutOff(int row, int col, double *mat, bool onGpu);
+    // xyz = xyz * mat in place, for count vertices stored as x, y and z
+    // planes. mat must be affine.
+    template <typename T>
+    static void transformPoints(int count, T *xyz, const T *mat);
 
-    static void multiply_add(double *a, const double *b, double x, int size);
+    template <typename T>
+    static void multiply_add(T *a, const T *b, T x, int size);
 };
@@ -0,0 +1,56 @@
+// AVX2 + FMA builds of the kernels in kernel_simd.h. Compiled with -mavx2
+// -mfma and only called after the CPU reported support for both.
+#if defined(__AVX2__) && defined(__FMA__)
+
+#include <immintrin.h>
+
+#include "kernel_simd_impl.h"
+
+struct AVX2Float {
+    typedef float T;
+    typedef __m256 Reg;
+    static const int WIDTH = 8;
+
+    static Reg set1(T v) { return _mm256_set1_ps(v); }
+    static Reg load(const T *p) { return _mm256_loadu_ps(p); }
+    static void store(T *p, Reg v) { _mm256_storeu_ps(p, v); }
+    static Reg fmadd(Reg a, Reg b, Reg c) { return _mm256_fmadd_ps(a, b, c); }
+    static Reg mul(Reg a, Reg b) { return _mm256_mul_ps(a, b); }
+    static Reg div(Reg a, Reg b) { return _mm256_div_ps(a, b); }
+    static Reg max(Reg a, Reg b) { return _mm256_max_ps(a, b); }
+    static Reg abs(Reg a) {
+        return _mm256_max_ps(a, _mm256_sub_ps(_mm256_setzero_ps(), a));
+    }
+    static Reg copysign(Reg mag, Reg sign) {
+        Reg zero = _mm256_setzero_ps();
+        Reg negative = _mm256_cmp_ps(sign, zero, _CMP_LT_OQ);
+        return _mm256_blendv_ps(mag, _mm256_sub_ps(zero, mag), negative);
+    }
+};
+
+struct AVX2Double {
+    typedef double T;
+    typedef __m256d Reg;
+    static const int WIDTH = 4;
+
+    static Reg set1(T v) { return _mm256_set1_pd(v); }
+    static Reg load(const T *p) { return _mm256_loadu_pd(p); }
+    static void store(T *p, Reg v) { _mm256_storeu_pd(p, v); }
+    static Reg fmadd(Reg a, Reg b, Reg c) { return _mm256_fmadd_pd(a, b, c); }
+    static Reg mul(Reg a, Reg b) { return _mm256_mul_pd(a, b); }
+    static Reg div(Reg a, Reg b) { return _mm256_div_pd(a, b); }
+    static Reg max(Reg a, Reg b) { return _mm256_max_pd(a, b); }
+    static Reg abs(Reg a) {
+        return _mm256_max_pd(a, _mm256_sub_pd(_mm256_setzero_pd(), a));
+    }
+    static Reg copysign(Reg mag, Reg sign) {
+        Reg zero = _mm256_setzero_pd();
+        Reg negative = _mm256_cmp_pd(sign, zero, _CMP_LT_OQ);
+        return _mm256_blendv_pd(mag, _mm256_sub_pd(zero, mag), negative);
+    }
+};
+
+DEFINE_SIMD_KERNELS(AVX2Float, AVX2)
+DEFINE_SIMD_KERNELS(AVX2Double, AVX2)
+
+#endif
@@ -0,0 +1,59 @@
+// AVX-512 builds of the kernels in kernel_simd.h. Compiled with -mavx512f
+// and only called after the CPU reported support for it.
+#if defined(__AVX512F__)
+
+#include <immintrin.h>
+
+#include "kernel_simd_impl.h"
+
+struct AVX512Float {
+    typedef float T;
+    typedef __m512 Reg;
+    static const int WIDTH = 16;
+    static const __mmask16 ALL = 0xffff;
+
+    static Reg set1(T v) { return _mm512_set1_ps(v); }
+    static Reg load(const T *p) { return _mm512_loadu_ps(p); }
+    static void store(T *p, Reg v) { _mm512_storeu_ps(p, v); }
+    static Reg fmadd(Reg a, Reg b, Reg c) { return _mm512_fmadd_ps(a, b, c); }
+    static Reg mul(Reg a, Reg b) { return _mm512_mul_ps(a, b); }
+    static Reg div(Reg a, Reg b) { return _mm512_div_ps(a, b); }
+    // the masked forms dodge a false -Wmaybe-uninitialized in GCC 12
+    static Reg max(Reg a, Reg b) { return _mm512_mask_max_ps(a, ALL, a, b); }
+    static Reg abs(Reg a) {
+        return max(a, _mm512_sub_ps(_mm512_setzero_ps(), a));
+    }
+    static Reg copysign(Reg mag, Reg sign) {
+        Reg zero = _mm512_setzero_ps();
+        __mmask16 negative = _mm512_cmp_ps_mask(sign, zero, _CMP_LT_OQ);
+        return _mm512_mask_sub_ps(mag, negative, zero, mag);
+    }
+};
+
+struct AVX512Double {
+    typedef double T;
+    typedef __m512d Reg;
+    static const int WIDTH = 8;
+    static const __mmask8 ALL = 0xff;
+
+    static Reg set1(T v) { return _mm512_set1_pd(v); }
+    static Reg load(const T *p) { return _mm512_loadu_pd(p); }
+    static void store(T *p, Reg v) { _mm512_storeu_pd(p, v); }
+    static Reg fmadd(Reg a, Reg b, Reg c) { return _mm512_fmadd_pd(a, b, c); }
+    static Reg mul(Reg a, Reg b) { return _mm512_mul_pd(a, b); }
+    static Reg div(Reg a, Reg b) { return _mm512_div_pd(a, b); }
+    static Reg max(Reg a, Reg b) { return _mm512_mask_max_pd(a, ALL, a, b); }
+    static Reg abs(Reg a) {
+        return max(a, _mm512_sub_pd(_mm512_setzero_pd(), a));
+    }
+    static Reg copysign(Reg mag, Reg sign) {
+        Reg zero = _mm512_setzero_pd();
+        __mmask8 negative = _mm512_cmp_pd_mask(sign, zero, _CMP_LT_OQ);
+        return _mm512_mask_sub_pd(mag, negative, zero, mag);
+    }
+};
+
+DEFINE_SIMD_KERNELS(AVX512Float, AVX512)
+DEFINE_SIMD_KERNELS(AVX512Double, AVX512)
+
+#endif
@@ -0,0 +1,218 @@
+// CPU implementation of the compute backend declared in kernel.h. Built by
+// `make cpu` in place of kernel.cu, so the renderer runs without CUDA. "Device"
+// memory is plain host memory and the per-vertex work is spread over the
+// ThreadPool.
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+
+#include "kernel_simd.h"
+#include "matrix.h"
+#include "threadpool.h"
+
+// rows handed to a single thread at a time
+static const int ROW_GRAIN = 4096;
+
+static const char *selectKernels();
+
+void GPU::init() {
+    ThreadPool::init();
+    const char *simd = selectKernels();
+    printf("CPU backend: %d threads, %s vertex kernels\n", ThreadPool::size(),
+           simd);
+}
+
+void GPU::synchronize() {}
+
+template <typename T>
+static void multiplyRows(int begin, int end, const int col1, const int col2,
+                         const T *v1, const T *v2, T *out) {
+    if (col1 == 4 && col2 == 4) {
+        // the shape of every per-vertex transform, fully unrolled
+        for (int i = begin; i < end; i++) {
+            const T *a = &v1[i * 4];
+            T a0 = a[0], a1 = a[1], a2 = a[2], a3 = a[3];
+            T *o = &out[i * 4];
+            for (int j = 0; j < 4; j++) {
+                o[j] = a0 * v2[j] + a1 * v2[4 + j] + a2 * v2[8 + j] +
+                       a3 * v2[12 + j];
+            }
+        }
+        return;
+    }
+    T row[col2];
+    for (int i = begin; i < end; i++) {
+        for (int j = 0; j < col2; j++) {
+            T value = 0;
+            for (int k = 0; k < col1; k++) {
+                value += v1[i * col1 + k] * v2[k * col2 + j];
+            }
+            row[j] = value;
+        }
+        // out may alias v1 for in-place transforms
+        std::memcpy(&out[i * col2], row, sizeof(T) * col2);
+    }
+}
+
+template <typename T>
+void GPU::multiply(const int row1, const int col1, const int col2, const T *v1,
+                   const T *v2, T *out, bool v1OnGpu, bool v2OnGpu,
+                   bool outOnGpu) {
+    (void)v1OnGpu;
+    (void)v2OnGpu;
+    (void)outOnGpu;
+
+    if (col1 == 4 && col2 == 4 && v2 == out) {
+        // keep a private copy of the right operand if it is overwritten
+        T right[16];
+        std::memcpy(right, v2, sizeof(right));
+        multiplyRows(0, row1, col1, col2, v1, right, out);
+        return;
+    }
+
+    ThreadPool::parallel_for(row1, ROW_GRAIN, [&](int begin, int end) {
+        multiplyRows(begin, end, col1, col2, v1, v2, out);
+    });
+}
+
+template <typename T>
+void GPU::normalizeAndCutOff(int row1, int col1, T *mat, bool onGpu) {
+    (void)onGpu;
+    ThreadPool::parallel_for(row1 * col1 / 4, ROW_GRAIN, [&](int begin,
+                                                               int end) {
+        for (int i = begin; i < end; i++) {
+            T *v = &mat[i * 4];
+            v[0] /= v[3];
+            v[1] /= v[3];
+            v[2] /= v[3];
+            v[3] = 1;
+            for (int j = 0; j < 4; j++) {
+                if (v[j] > 1 || v[j] < -1) {
+                    v[j] = 0;
+                }
+            }
+        }
+    });
+}
+
+// The vertex kernels in use, scalar until GPU::init has seen the CPU
+template <typename T>
+struct VertexKernels {
+    void (*transform)(int, int, int, const T *, const T *, const T *,
+                      float *, int, float *, float *);
+    void (*transformPoints)(int, int, int, T *, const T *);
+};
+
+template <typename T>
+static void transformScalar(int begin, int end, int count, const T *in,
+                            const T *clip, const T *screen, float *xy,
+                            int xyStride, float *depth, float *w) {
+    for (int i = begin; i < end; i++) {
+        transformVertex(i, count, in, clip, screen, xy, xyStride, depth, w);
+    }
+}
+
+template <typename T>
+static void transformPointsScalar(int begin, int end, int count, T *xyz,
+                                  const T *mat) {
+    for (int i = begin; i < end; i++) transformPoint(i, count, xyz, mat);
+}
+
+static VertexKernels<float> floatKernels = {transformScalar<float>,
+                                            transformPointsScalar<float>};
+static VertexKernels<double> doubleKernels = {transformScalar<double>,
+                                              transformPointsScalar<double>};
+
+static VertexKernels<float> &kernels(float *) { return floatKernels; }
+static VertexKernels<double> &kernels(double *) { return doubleKernels; }
+
+// Picks the widest kernels the CPU runs. RENDERER_SIMD=scalar|avx2|avx512
+// caps the choice, to compare them.
+static const char *selectKernels() {
+    const char *cap = getenv("RENDERER_SIMD");
+    const char *name = "scalar";
+    if (cap && strcmp(cap, "scalar") == 0) return name;
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        floatKernels = {transformAVX2, transformPointsAVX2};
+        doubleKernels = {transformAVX2, transformPointsAVX2};
+        name = "avx2";
+    }
+    if (cap && strcmp(cap, "avx2") == 0) return name;
+    if (__builtin_cpu_supports("avx512f")) {
+        floatKernels = {transformAVX512, transformPointsAVX512};
+        doubleKernels = {transformAVX512, transformPointsAVX512};
+        name = "avx512";
+    }
+#endif
+    return name;
+}
+
+template <typename T>
+void GPU::transform(int count, int instances, const T *in, const T *clips,
+                    const T *screen, const ScreenOutput &out) {
+    auto kernel = kernels((T *)NULL).transform;
+    // the pool counts in ints, so hand it as many whole instances at a time
+    // as fit in one
+    const int batch =
+        count > 0 && INT_MAX / count < instances ? INT_MAX / count : instances;
+    for (int done = 0; done < instances; done += batch) {
+        const int n = instances - done < batch ? instances - done : batch;
+        // the range covers every instance, split it where instances meet
+        ThreadPool::parallel_for(count * n, ROW_GRAIN, [&](int begin, int end) {
+            while (begin < end) {
+                int k = begin / count;
+                int last = (k + 1) * count < end ? (k + 1) * count : end;
+                const size_t first = (size_t)(done + k) * count;
+                kernel(begin - k * count, last - k * count, count, in,
+                       &clips[(size_t)(done + k) * 16], screen,
+                       out.xy + first * out.xyStride, out.xyStride,
+                       out.depth ? out.depth + first : NULL, out.w + first);
+                begin = last;
+            }
+        });
+    }
+}
+
+template <typename T>
+void GPU::transformPoints(int count, T *xyz, const T *mat) {
+    auto kernel = kernels((T *)NULL).transformPoints;
+    ThreadPool::parallel_for(count, ROW_GRAIN, [&](int begin, int end) {
+        kernel(begin, end, count, xyz, mat);
+    });
+}
+
+template <typename T>
+void GPU::multiply_add(T *b, const T *a, T x, int size) {
+    for (int i = 0; i < size; i++) {
+        b[i] += a[i] * x;
+    }
+}
+
+#define INSTANTIATE(T)                                                       \
+    template void GPU::multiply(const int, const int, const int, const T *, \
+                                const T *, T *, bool, bool, bool);           \
+    template void GPU::normalizeAndCutOff(int, int, T *, bool);              \
+    template void GPU::transform(int, int, const T *, const T *, const T *,  \
+                                 const ScreenOutput &);                      \
+    template void GPU::transformPoints(int, T *, const T *);                 \
+    template void GPU::multiply_add(T *, const T *, T, int);
+
+INSTANTIATE(float)
+INSTANTIATE(double)
+
+// device memory is plain host memory here
+void *GPU::deviceAlloc(size_t size) { return std::malloc(size); }
+
+void GPU::deviceFree(void *mem) { std::free(mem); }
+
+void GPU::deviceCopy(void *dst, const void *src, size_t size) {
+    std::memcpy(dst, src, size);
+}
+
+void GPU::memcpy(void *dst, void *src, size_t siz, bool reverse) {
+    std::memcpy(dst, src, siz);
+    Profiler::count(
+        reverse ? Profiler::BYTES_FROM_DEVICE : Profiler::BYTES_TO_DEVICE, siz);
+}
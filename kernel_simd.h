@@ -0,0 +1,69 @@
+#pragma once
+
+// Vertex kernels of the CPU backend. Every kernel works on the vertices
+// [begin, end) of planes holding count vertices each (see VertexArray), so
+// kernel_cpu.cpp can split the work over the ThreadPool. transform writes
+// vertex i to the outputs of GPU::transform (see ScreenOutput), with xy, depth
+// and w already pointing at the instance.
+// Besides the scalar versions below there are AVX2 (kernel_avx2.cpp) and
+// AVX-512 (kernel_avx512.cpp) builds, picked at runtime by what the CPU
+// supports.
+//
+// This header is also compiled with -mavx2 / -mavx512f, so it must stay free
+// of standard library includes.
+
+#define SIMD_KERNELS(T, ISA)                                                   \
+    void transform##ISA(int begin, int end, int count, const T *in,            \
+                        const T *clip, const T *screen, float *xy,             \
+                        int xyStride, float *depth, float *w);                 \
+    void transformPoints##ISA(int begin, int end, int count, T *xyz,           \
+                              const T *mat);
+
+SIMD_KERNELS(float, AVX2)
+SIMD_KERNELS(double, AVX2)
+SIMD_KERNELS(float, AVX512)
+SIMD_KERNELS(double, AVX512)
+
+#undef SIMD_KERNELS
+
+// clip space w closer to zero than this is pushed away from it
+#define W_EPSILON 1e-12
+
+// One vertex of GPU::transform, for the scalar kernel. The vector kernels
+// fuse its multiply-adds, so their results can differ from it in the last
+// bits.
+template <typename T>
+static inline void transformVertex(int i, int count, const T *in,
+                                   const T *clip, const T *screen, float *xy,
+                                   int xyStride, float *depth, float *w) {
+    const T x = in[i], y = in[count + i], z = in[2 * count + i];
+    T p[4];
+    for (int j = 0; j < 4; j++) {
+        p[j] = x * clip[j] + y * clip[4 + j] + z * clip[8 + j] + clip[12 + j];
+    }
+    // no cutoff here, faces crossing the near plane are clipped later
+    T pw = p[3];
+    if (pw < (T)W_EPSILON && pw > (T)-W_EPSILON) {
+        pw = pw < 0 ? (T)-W_EPSILON : (T)W_EPSILON;
+    }
+    const T inv = 1 / pw;
+    const T nx = p[0] * inv, ny = p[1] * inv, nz = p[2] * inv;
+    T s[3];
+    for (int j = 0; j < 3; j++) {
+        s[j] = nx * screen[j] + ny * screen[4 + j] + nz * screen[8 + j] +
+               screen[12 + j];
+    }
+    xy[i * xyStride] = (float)s[0];
+    xy[i * xyStride + 1] = (float)s[1];
+    if (depth) depth[i] = (float)s[2];
+    w[i] = (float)pw;
+}
+
+template <typename T>
+static inline void transformPoint(int i, int count, T *xyz, const T *mat) {
+    T *xs = xyz, *ys = xyz + count, *zs = xyz + 2 * count;
+    const T x = xs[i], y = ys[i], z = zs[i];
+    xs[i] = x * mat[0] + y * mat[4] + z * mat[8] + mat[12];
+    ys[i] = x * mat[1] + y * mat[5] + z * mat[9] + mat[13];
+    zs[i] = x * mat[2] + y * mat[6] + z * mat[10] + mat[14];
+}
@@ -0,0 +1,138 @@
+#pragma once
+
+// Vector bodies of the kernels in kernel_simd.h, written once against a
+// small traits type (V::T scalar, V::Reg register, V::WIDTH lanes) and
+// included by each instruction set's translation unit.
+
+#include "kernel_simd.h"
+
+// Transforms V::WIDTH vertices, leaving screen x, y, depth and clip w in
+// the rows of lanes
+template <typename V>
+static inline void transformBlock(typename V::Reg x, typename V::Reg y,
+                                  typename V::Reg z, const typename V::Reg *c,
+                                  const typename V::Reg *s,
+                                  typename V::T lanes[4][V::WIDTH]) {
+    typedef typename V::T T;
+    typedef typename V::Reg Reg;
+    Reg p[4];
+    for (int j = 0; j < 4; j++) {
+        p[j] = V::fmadd(x, c[j],
+                        V::fmadd(y, c[4 + j],
+                                 V::fmadd(z, c[8 + j], c[12 + j])));
+    }
+    // at least W_EPSILON away from zero, on the side w is on
+    Reg pw = V::copysign(V::max(V::abs(p[3]), V::set1((T)W_EPSILON)), p[3]);
+    Reg inv = V::div(V::set1(1), pw);
+    Reg nx = V::mul(p[0], inv), ny = V::mul(p[1], inv), nz = V::mul(p[2], inv);
+    for (int j = 0; j < 3; j++) {
+        V::store(lanes[j],
+                 V::fmadd(nx, s[j],
+                          V::fmadd(ny, s[3 + j],
+                                   V::fmadd(nz, s[6 + j], s[9 + j]))));
+    }
+    V::store(lanes[3], pw);
+}
+
+template <typename V>
+static void transformBody(int begin, int end, int count,
+                          const typename V::T *in, const typename V::T *clip,
+                          const typename V::T *screen, float *xy, int xyStride,
+                          float *depth, float *w) {
+    typedef typename V::T T;
+    typedef typename V::Reg Reg;
+    const T *xs = in, *ys = in + count, *zs = in + 2 * count;
+
+    Reg c[16], s[12];
+    for (int k = 0; k < 16; k++) c[k] = V::set1(clip[k]);
+    // the w column of screen is never needed, the output w is the clip w
+    for (int r = 0; r < 4; r++) {
+        for (int j = 0; j < 3; j++) s[r * 3 + j] = V::set1(screen[r * 4 + j]);
+    }
+
+    // the last few vertices go through the same code, copied into a full
+    // block, so a vertex comes out the same wherever the pool splits
+    for (int i = begin; i < end; i += V::WIDTH) {
+        const int n = end - i < V::WIDTH ? end - i : V::WIDTH;
+        T lanes[4][V::WIDTH];
+        if (n == V::WIDTH) {
+            transformBlock<V>(V::load(&xs[i]), V::load(&ys[i]),
+                              V::load(&zs[i]), c, s, lanes);
+        } else {
+            T tail[3][V::WIDTH] = {};
+            for (int l = 0; l < n; l++) {
+                tail[0][l] = xs[i + l];
+                tail[1][l] = ys[i + l];
+                tail[2][l] = zs[i + l];
+            }
+            transformBlock<V>(V::load(tail[0]), V::load(tail[1]),
+                              V::load(tail[2]), c, s, lanes);
+        }
+        // the outputs are floats, x and y interleaved into the vertices, so
+        // the lanes go out one by one
+        for (int l = 0; l < n; l++) {
+            xy[(i + l) * xyStride] = (float)lanes[0][l];
+            xy[(i + l) * xyStride + 1] = (float)lanes[1][l];
+            w[i + l] = (float)lanes[3][l];
+        }
+        if (depth) {
+            for (int l = 0; l < n; l++) depth[i + l] = (float)lanes[2][l];
+        }
+    }
+}
+
+template <typename V>
+static void transformPointsBody(int begin, int end, int count,
+                                typename V::T *xyz,
+                                const typename V::T *mat) {
+    typedef typename V::Reg Reg;
+    typedef typename V::T T;
+    T *xs = xyz, *ys = xyz + count, *zs = xyz + 2 * count;
+
+    Reg m[12];
+    for (int r = 0; r < 4; r++) {
+        for (int j = 0; j < 3; j++) m[r * 3 + j] = V::set1(mat[r * 4 + j]);
+    }
+
+    T *o[3] = {xs, ys, zs};
+    int i = begin;
+    for (; i + V::WIDTH <= end; i += V::WIDTH) {
+        Reg x = V::load(&xs[i]), y = V::load(&ys[i]), z = V::load(&zs[i]);
+        for (int j = 0; j < 3; j++) {
+            V::store(&o[j][i],
+                     V::fmadd(x, m[j],
+                              V::fmadd(y, m[3 + j],
+                                       V::fmadd(z, m[6 + j], m[9 + j]))));
+        }
+    }
+    if (i == end) return;
+
+    // as in transformBody, the tail goes through a padded full block
+    const int n = end - i;
+    T tail[3][V::WIDTH] = {};
+    for (int j = 0; j < 3; j++) {
+        for (int l = 0; l < n; l++) tail[j][l] = o[j][i + l];
+    }
+    Reg x = V::load(tail[0]), y = V::load(tail[1]), z = V::load(tail[2]);
+    for (int j = 0; j < 3; j++) {
+        V::store(tail[j],
+                 V::fmadd(x, m[j],
+                          V::fmadd(y, m[3 + j],
+                                   V::fmadd(z, m[6 + j], m[9 + j]))));
+    }
+    for (int j = 0; j < 3; j++) {
+        for (int l = 0; l < n; l++) o[j][i + l] = tail[j][l];
+    }
+}
+
+#define DEFINE_SIMD_KERNELS(V, ISA)                                          \
+    void transform##ISA(int begin, int end, int count, const V::T *in,       \
+                        const V::T *clip, const V::T *screen, float *xy,     \
+                        int xyStride, float *depth, float *w) {              \
+        transformBody<V>(begin, end, count, in, clip, screen, xy, xyStride,  \
+                         depth, w);                                          \
+    }                                                                        \
+    void transformPoints##ISA(int begin, int end, int count, V::T *xyz,      \
+                              const V::T *mat) {                             \
+        transformPointsBody<V>(begin, end, count, xyz, mat);                 \
+    }
@@ -0,0 +1,72 @@
+#include "loader.h"
+
+#include <cstring>
+
+void MeshLoader::start(Renderer *r) {
+    renderer = r;
+    stopping = false;
+    thread = std::thread(&MeshLoader::loop, this);
+}
+
+void MeshLoader::stop() {
+    if (!thread.joinable()) return;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+        queue.clear();
+    }
+    wake.notify_all();
+    thread.join();
+    // prefetched objects nobody asked for
+    entries.clear();
+}
+
+MeshLoader::Entry *MeshLoader::find(const char *file) {
+    for (Entry &entry : entries) {
+        if (strcmp(entry.file, file) == 0) return &entry;
+    }
+    return NULL;
+}
+
+void MeshLoader::request(const char *file) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (find(file)) return;
+        entries.push_back({file, false, Object3D()});
+        queue.push_back(file);
+    }
+    wake.notify_one();
+}
+
+bool MeshLoader::take(const char *file, Object3D &obj) {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (size_t i = 0; i < entries.size(); i++) {
+        if (strcmp(entries[i].file, file) != 0) continue;
+        if (!entries[i].ready) return false;
+        obj = std::move(entries[i].object);
+        entries.erase(entries.begin() + i);
+        return true;
+    }
+    return false;
+}
+
+void MeshLoader::loop() {
+    while (true) {
+        const char *file;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            wake.wait(lock, [&] { return stopping || !queue.empty(); });
+            if (stopping) return;
+            file = queue.front();
+            queue.pop_front();
+        }
+
+        // parsing, uploading and preparing all happen off the frame loop
+        Object3D obj = Object3D::loadObj(file, renderer);
+
+        std::lock_guard<std::mutex> lock(mutex);
+        Entry *entry = find(file);
+        entry->object = std::move(obj);
+        entry->ready = true;
+    }
+}
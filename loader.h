@@ -0,0 +1,48 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "object3d.h"
+
+struct Renderer;
+
+// Loads objects on a background thread, so the frame loop keeps drawing the
+// current object while the next one is parsed and uploaded. Finished objects
+// wait in the loader until they are taken.
+struct MeshLoader {
+    MeshLoader() : renderer(NULL), stopping(false) {}
+    ~MeshLoader() { stop(); }
+
+    void start(Renderer *r);
+    void stop();
+
+    // Starts loading file in the background, unless it is already queued,
+    // loading or loaded. Returns immediately.
+    void request(const char *file);
+
+    // Moves the object loaded from file into obj once it is ready. Returns
+    // false while it is still loading.
+    bool take(const char *file, Object3D &obj);
+
+   private:
+    struct Entry {
+        const char *file;
+        bool ready;
+        Object3D object;
+    };
+
+    Renderer *renderer;
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::deque<const char *> queue;
+    std::vector<Entry> entries;
+    bool stopping;
+
+    Entry *find(const char *file);
+    void loop();
+};
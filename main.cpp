@@ -1,3 +1,4 @@
+#include "offline.h"
 #include "renderer.h"
 
 int main(int argc, char** argv) {
@@ -5,7 +6,13 @@ int main(int argc, char** argv) {
     (void)argv;
 
     Renderer r = Renderer(argc, argv);
-    r.run();
+    if (r.renderDir) {
+        if (OfflineRenderer::run(&r) > 0) return 1;
+    } else if (r.headlessFrames > 0) {
+        if (r.runHeadless() > 0) return 1;
+    } else {
+        r.run();
+    }
 
     return 0;
 }
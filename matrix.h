@@ -4,56 +4,123 @@
 #include <math.h>
 
 #include <cstdio>
+#include <type_traits>
+#include <utility>
+#include <vector>
 
 #include "kernel.h"
+#include "profiler.h"
+
+template <typename T>
+struct BasicPoint3D {
+    T x, y, z;
+    BasicPoint3D() : x(0), y(0), z(0) {}
+    BasicPoint3D(T a, T b, T c) {
+        x = a;
+        y = b;
+        z = c;
+    }
+    BasicPoint3D(const BasicPoint3D &other)
+        : x(other.x), y(other.y), z(other.z) {}
+    BasicPoint3D &operator=(const BasicPoint3D &other) = default;
+};
+
+// Row major M x N matrix in host memory, for the camera, projection and
+// model transforms. Every operation is constexpr and expanded over the
+// element indices at compile time, so a 4x4 product is 64 multiply adds with
+// no loops, no allocation and no backend call. Only the final composed
+// matrices are uploaded, see Object3D::screenProjection.
+template <int M, int N, typename T = real>
+struct SmallMatrix {
+    T values[M * N];
+
+    constexpr SmallMatrix() : values() {}
+
+    template <typename... V,
+              typename = std::enable_if_t<sizeof...(V) == M * N>>
+    constexpr SmallMatrix(const V &...newval) : values{(T)newval...} {}
+
+    static constexpr SmallMatrix identity() {
+        return identity(std::make_index_sequence<M * N>());
+    }
+
+    template <typename... V>
+    constexpr void fill(const V &...newval) {
+        *this = SmallMatrix(newval...);
+    }
+
+    constexpr const T &at(int i) const { return values[i]; }
+    constexpr T &at(int i) { return values[i]; }
+    constexpr const T &at(int i, int j) const { return values[i * N + j]; }
+    constexpr T &at(int i, int j) { return values[i * N + j]; }
+
+    template <int O>
+    constexpr SmallMatrix<M, O, T> operator*(
+        const SmallMatrix<N, O, T> &other) const {
+        return multiply(other, std::make_index_sequence<M * O>());
+    }
+
+    // this += other * val, and -=
+    constexpr void multiply_add(const SmallMatrix &other, T val) {
+        *this = axpy(other, val, std::make_index_sequence<M * N>());
+    }
+    constexpr void multiply_sub(const SmallMatrix &other, T val) {
+        *this = axpy(other, -val, std::make_index_sequence<M * N>());
+    }
 
 #ifdef DEBUG
-#define MEASURE(x)                                      \
-    do {                                                \
-        Uint64 start_step = SDL_GetTicks64();           \
-        x;                                              \
-        Uint64 end_step = SDL_GetTicks64();             \
-        printf(#x ": %3ldms\n", end_step - start_step); \
-    } while (0)
-
-#define MEASURE_START(x) Uint64 __measure_start_##x = SDL_GetTicks64();
-#define MEASURE_END(x)                           \
-    Uint64 __measure_end_##x = SDL_GetTicks64(); \
-    printf(#x ": %3ldms\n", __measure_end_##x - __measure_start_##x);
-#else
-#define MEASURE(x) x;
-#define MEASURE_START(x)
-#define MEASURE_END(x)
+    bool print() const {
+        for (int i = 0; i < M; i++) {
+            for (int j = 0; j < N; j++) printf("%g ", (double)at(i, j));
+            printf("\n");
+        }
+        printf("\n");
+        return true;
+    }
 #endif
 
-template <int M, int N>
-struct ConstantMatrix;
+   private:
+    template <size_t... I>
+    static constexpr SmallMatrix identity(std::index_sequence<I...>) {
+        return SmallMatrix((T)(I / N == I % N)...);
+    }
 
-struct Point3D {
-    double x, y, z;
-    Point3D() : x(0), y(0), z(0) {}
-    Point3D(double a, double b, double c) {
-        x = a;
-        y = b;
-        z = c;
+    template <int O, size_t... K>
+    constexpr T dot(const SmallMatrix<N, O, T> &other, int i, int j,
+                    std::index_sequence<K...>) const {
+        return (... + (values[i * N + K] * other.values[K * O + j]));
+    }
+
+    template <int O, size_t... I>
+    constexpr SmallMatrix<M, O, T> multiply(const SmallMatrix<N, O, T> &other,
+                                            std::index_sequence<I...>) const {
+        return SmallMatrix<M, O, T>(
+            dot(other, I / O, I % O, std::make_index_sequence<N>())...);
+    }
+
+    template <size_t... I>
+    constexpr SmallMatrix axpy(const SmallMatrix &other, T val,
+                               std::index_sequence<I...>) const {
+        return SmallMatrix((values[I] + other.values[I] * val)...);
     }
-    Point3D(const Point3D &other) : x(other.x), y(other.y), z(other.z) {}
 };
 
-struct Matrix {
+// Row major matrix in device memory, with T as the scalar type
+template <typename T>
+struct BasicMatrix {
     int row, col, allocated_rows;
-    double *values;
-    double *cpu_values;
+    T *values;
+    T *cpu_values;
 
 #ifdef DEBUG
-    double *print_values_cpy;
+    T *print_values_cpy;
 #endif
 
-    Matrix(int r, int c) {
+    BasicMatrix(int r, int c) {
         row = r;
         col = c;
         allocated_rows = r;
-        values = (double *)GPU::malloc(sizeof(double) * (row * col));
+        values = (T *)GPU::malloc(sizeof(T) * (row * col));
         cpu_values = NULL;
 
 #ifdef DEBUG
@@ -62,13 +129,13 @@ struct Matrix {
     }
 
     void moveToCpu() {
-        cpu_values = (double *)malloc(sizeof(double) * (row * col));
-        GPU::memcpy(cpu_values, values, sizeof(double) * (row * col), true);
+        cpu_values = (T *)realloc(cpu_values, sizeof(T) * (row * col));
+        GPU::memcpy(cpu_values, values, sizeof(T) * (row * col), true);
     }
 
-    double at(int i, int j) { return cpu_values[i * col + j]; }
+    T at(int i, int j) { return cpu_values[i * col + j]; }
 
-    Matrix() {
+    BasicMatrix() {
         row = col = allocated_rows = 0;
         values = NULL;
         cpu_values = NULL;
@@ -77,46 +144,87 @@ struct Matrix {
 #endif
     }
 
-    template <typename... T>
-    Matrix(int r, int c, const T &...newvals) : Matrix(r, c) {
-        double tempValues[r * c];
+    // owns its buffers, so it can only be moved. Copy the values explicitly
+    // when that is really wanted.
+    BasicMatrix(const BasicMatrix &) = delete;
+    BasicMatrix &operator=(const BasicMatrix &) = delete;
+
+    BasicMatrix(BasicMatrix &&other) noexcept : BasicMatrix() { swap(other); }
+
+    BasicMatrix &operator=(BasicMatrix &&other) noexcept {
+        swap(other);
+        return *this;
+    }
+
+    ~BasicMatrix() { destroy(); }
+
+    void swap(BasicMatrix &other) noexcept {
+        std::swap(row, other.row);
+        std::swap(col, other.col);
+        std::swap(allocated_rows, other.allocated_rows);
+        std::swap(values, other.values);
+        std::swap(cpu_values, other.cpu_values);
+#ifdef DEBUG
+        std::swap(print_values_cpy, other.print_values_cpy);
+#endif
+    }
+
+    template <typename... V>
+    BasicMatrix(int r, int c, const V &...newvals) : BasicMatrix(r, c) {
+        T tempValues[r * c];
         assign(tempValues, 0, newvals...);
-        GPU::memcpy(values, tempValues, sizeof(double) * r * c);
+        GPU::memcpy(values, tempValues, sizeof(T) * r * c);
     }
 
-    template <typename... T>
-    constexpr static void assign(double *values, int index, const double &val,
-                                 const T &...next) {
-        values[index] = val;
+    template <typename V, typename... Rest>
+    constexpr static void assign(T *values, int index, const V &val,
+                                 const Rest &...next) {
+        values[index] = (T)val;
         assign(values, index + 1, next...);
     }
 
-    constexpr static void assign(double *values, int index) {
+    constexpr static void assign(T *values, int index) {
         (void)values;
         (void)index;
     }
 
-    template <typename... T>
-    void appendRow(const T &...val) {
-        double newValues[col];
+    template <typename... V>
+    void appendRow(const V &...val) {
+        T newValues[col];
         assign(newValues, 0, val...);
         if (row == allocated_rows) {
             if (allocated_rows == 0)
                 allocated_rows = 2;
             else
                 allocated_rows *= 2;
-            values =
-                (double *)GPU::realloc(values, sizeof(double) * row * col,
-                                       sizeof(double) * allocated_rows * col);
+            values = (T *)GPU::realloc(values, sizeof(T) * row * col,
+                                       sizeof(T) * allocated_rows * col);
         }
-        GPU::memcpy(&values[row * col], newValues, sizeof(double) * col);
+        GPU::memcpy(&values[row * col], newValues, sizeof(T) * col);
         row++;
     }
 
+    // Replaces the contents with rows x col values from host memory, in a
+    // single transfer. Values of another scalar type are converted first.
+    template <typename S>
+    void assignRows(const S *host, int rows) {
+        if (rows > allocated_rows) {
+            if (values) GPU::free(values);
+            values = (T *)GPU::malloc(sizeof(T) * rows * col);
+            allocated_rows = rows;
+        }
+        if (std::is_same<S, T>::value) {
+            GPU::memcpy(values, (void *)host, sizeof(T) * rows * col);
+        } else {
+            std::vector<T> converted(host, host + (size_t)rows * col);
+            GPU::memcpy(values, converted.data(), sizeof(T) * rows * col);
+        }
+        row = rows;
+    }
+
     static inline void multiply(const int row1, const int col1, const int col2,
-                                const double *left_values,
-                                const double *right_values, double *result,
-                                bool leftOnGpu, bool rightOnGpu,
+                                const T *left_values, const T *right_values,
+                                T *result, bool leftOnGpu, bool rightOnGpu,
                                 bool resultOnGpu) {
         GPU::multiply(row1, col1, col2, left_values, right_values, result,
                       leftOnGpu, rightOnGpu, resultOnGpu);
@@ -124,15 +232,14 @@ struct Matrix {
 
     void finalize_dimension() {
         if (allocated_rows > row) {
-            values = (double *)GPU::realloc(
-                values, sizeof(double) * allocated_rows * col,
-                sizeof(double) * row * col);
+            values = (T *)GPU::realloc(values, sizeof(T) * allocated_rows * col,
+                                       sizeof(T) * row * col);
             allocated_rows = row;
         }
     }
 
-    Matrix operator*(const Matrix &newmat) {
-        Matrix res(row, newmat.col);
+    BasicMatrix operator*(const BasicMatrix &newmat) {
+        BasicMatrix res(row, newmat.col);
         multiply(row, col, newmat.col, values, newmat.values, res.values, true,
                  true, true);
         return res;
@@ -144,10 +251,10 @@ struct Matrix {
 
 #ifdef DEBUG
 
-    static bool print_values(double *values, int row, int col) {
+    static bool print_values(T *values, int row, int col) {
         for (int i = 0; i < row; i++) {
             for (int j = 0; j < col; j++) {
-                printf("%g ", values[i * col + j]);
+                printf("%g ", (double)values[i * col + j]);
             }
             printf("\n");
         }
@@ -157,228 +264,159 @@ struct Matrix {
 
     bool print() {
         if (!print_values_cpy) {
-            print_values_cpy = (double *)malloc(sizeof(double) * row * col);
+            print_values_cpy = (T *)malloc(sizeof(T) * row * col);
         }
-        GPU::memcpy(print_values_cpy, values, sizeof(double) * row * col, true);
-        return Matrix::print_values(print_values_cpy, row, col);
+        GPU::memcpy(print_values_cpy, values, sizeof(T) * row * col, true);
+        return print_values(print_values_cpy, row, col);
     }
 
 #endif
 
-    void destroy() { GPU::free(values); }
-
-    // ~Matrix() { free(values); }
-};
-
-template <int M, int N>
-struct ConstantMatrix {
-   private:
-    double *gpu_values, *cpu_values;
-    GPU::Buffer *buffer;
-    bool dirty;
-
-    void copyToCPU() {
-        if (dirty) {
-            if (!cpu_values) {
-                cpu_values = (double *)malloc(sizeof(double) * M * N);
-            }
-            GPU::memcpy(cpu_values, gpu_values, sizeof(double) * M * N, true);
-        }
-    }
-
-   public:
-    ConstantMatrix() {
-        buffer = GPU::Buffer::alloc(M * N);
-        gpu_values = buffer->values;
+    // Frees the buffers now instead of at destruction
+    void destroy() {
+        GPU::free(values);
+        free(cpu_values);
+        values = NULL;
         cpu_values = NULL;
-        dirty = true;
-    }
-
-    template <typename... T>
-    ConstantMatrix(const T &...newval) : ConstantMatrix() {
-        fill(newval...);
-    }
-
-    ConstantMatrix(const ConstantMatrix<M, N> &other) : ConstantMatrix() {
-        GPU::memcpy(gpu_values, other.gpu_values, sizeof(double) * M * N);
-    }
-
-    ConstantMatrix<M, N> &operator=(const ConstantMatrix<M, N> &other) {
-        GPU::memcpy(gpu_values, other.gpu_values, sizeof(double) * M * N);
-        dirty = true;
-        return *this;
-    }
-
-    template <typename... T>
-    void fill(const T &...newval) {
-        double values[M * N];
-        Matrix::assign(values, 0, newval...);
-        GPU::memcpy(gpu_values, values, sizeof(double) * M * N);
-        dirty = true;
+#ifdef DEBUG
+        free(print_values_cpy);
+        print_values_cpy = NULL;
+#endif
+        row = allocated_rows = 0;
     }
+};
 
-    template <int O>
-    ConstantMatrix<M, O> operator*(const ConstantMatrix<N, O> &newmat) {
-        ConstantMatrix<M, O> result;
-
-        /*
-        int left_pointer = 0;
-        int result_pointer = 0;
-        for (int i = 0; i < M; ++i) {
-            for (int j = 0; j < O; ++j) {
-                int right_pointer = 0;
-                result.values[result_pointer + j] = 0;
-                for (int k = 0; k < N; ++k) {
-                    result.values[result_pointer + j] +=
-                        values[left_pointer + k] *
-                        newmat.values[right_pointer + j];
-                    right_pointer += O;
-                }
-            }
-            left_pointer += N;
-            result_pointer += O;
-        }
-        */
+typedef BasicPoint3D<real> Point3D;
+typedef BasicMatrix<real> Matrix;
 
-        Matrix::multiply(M, N, O, gpu_values, newmat.getGPUValues(),
-                         result.getGPUValues(), true, true, true);
-        return result;
-    }
+// Per vertex data as structure of arrays in device memory: plane k holds
+// component k of every vertex, so the plane pointers are values + k * count.
+// Positions use three planes (x, y, z) with an implicit w of 1.
+template <typename T>
+struct BasicVertexArray {
+    int count, planes;
+    int capacity;  // vertices values has room for, at least count
+    T *values;
 
-    Matrix operator*(const Matrix &newmat) {
-        Matrix res(M, newmat.col);
-        Matrix::multiply(M, N, newmat.col, gpu_values, newmat.values,
-                         res.values, true, true, true);
-        return res;
-    }
-
-    inline void multiply_add(const ConstantMatrix<M, N> &other, double val) {
-        GPU::multiply_add(gpu_values, other.gpu_values, val, M * N);
-        dirty = true;
+    BasicVertexArray() {
+        count = planes = capacity = 0;
+        values = NULL;
     }
 
-    inline void multiply_sub(const ConstantMatrix<M, N> &other, double val) {
-        GPU::multiply_add(gpu_values, other.gpu_values, -val, M * N);
-        dirty = true;
+    BasicVertexArray(int n, int p) {
+        count = capacity = n;
+        planes = p;
+        values = (T *)GPU::malloc(sizeof(T) * count * planes);
     }
 
-    inline double *getGPUValues() const { return gpu_values; }
-
-    const double &at(int i) {
-        copyToCPU();
-        return cpu_values[i];
-    }
-    double &at(int i, int j) { return at(i * N + j); }
+    BasicVertexArray(const BasicVertexArray &) = delete;
+    BasicVertexArray &operator=(const BasicVertexArray &) = delete;
 
-#ifdef DEBUG
-    bool print() {
-        copyToCPU();
-        return Matrix::print_values(cpu_values, M, N);
+    BasicVertexArray(BasicVertexArray &&other) noexcept : BasicVertexArray() {
+        swap(other);
     }
-#endif
-
-    ~ConstantMatrix() { buffer->free(); }
-};
-
-template <int M, int N>
-Matrix operator*(const Matrix &mat1, const ConstantMatrix<M, N> &mat2) {
-    Matrix res(mat1.row, mat2.col);
-    Matrix::multiply(mat1.row, mat1.col, N, mat1.values, mat2.getGPUValues(),
-                     res.values, true, true, true);
-    return res;
-}
-
-struct ProjectionMatrix : public Matrix {
-    double *swap_buffer;
-    double *screen_buffer;
-    bool dirty;
 
-    ProjectionMatrix() {
-        swap_buffer = NULL;
-        screen_buffer = NULL;
-        dirty = true;
+    BasicVertexArray &operator=(BasicVertexArray &&other) noexcept {
+        swap(other);
+        return *this;
     }
 
-    template <typename... T>
-    ProjectionMatrix(int r, int c, const T &...newvals)
-        : Matrix(r, c, newvals...) {
-        swap_buffer = (double *)GPU::malloc(sizeof(double) * (row * col));
-        screen_buffer = (double *)malloc(sizeof(double) * row * col);
-        dirty = true;
-    }
+    ~BasicVertexArray() { destroy(); }
 
-    ProjectionMatrix(int r, int c) : Matrix(r, c) {
-        swap_buffer = (double *)GPU::malloc(sizeof(double) * (row * col));
-        screen_buffer = (double *)malloc(sizeof(double) * row * col);
-        dirty = true;
+    void swap(BasicVertexArray &other) noexcept {
+        std::swap(count, other.count);
+        std::swap(planes, other.planes);
+        std::swap(capacity, other.capacity);
+        std::swap(values, other.values);
     }
 
-    void multiply_and_assign(const Matrix &mat1,
-                             const ConstantMatrix<4, 4> &mat2) {
-        Matrix::multiply(mat1.row, mat1.col, 4, mat1.values,
-                         mat2.getGPUValues(), values, true, true, true);
-        dirty = true;
-    }
+    T *plane(int k) const { return &values[(size_t)k * count]; }
 
-    void multiply(const ConstantMatrix<4, 4> &mat2) {
-        Matrix::multiply(row, col, 4, values, mat2.getGPUValues(), swap_buffer,
-                         true, true, true);
-        double *bak = values;
-        values = swap_buffer;
-        swap_buffer = bak;
-        dirty = true;
+    // Sets count, keeping the storage while it has room. The values are
+    // undefined afterwards, as the planes move with count.
+    void resize(int n) {
+        if (n > capacity) {
+            GPU::free(values);
+            values = (T *)GPU::malloc(sizeof(T) * n * planes);
+            capacity = n;
+        }
+        count = n;
+    }
+
+    // Replaces the contents with the first `planes` columns of rows x stride
+    // row major host values, in a single transfer
+    template <typename S>
+    void assign(const S *host, int rows, int stride) {
+        resize(rows);
+        std::vector<T> split((size_t)count * planes);
+        for (int i = 0; i < count; i++) {
+            for (int k = 0; k < planes; k++) {
+                split[(size_t)k * count + i] = (T)host[(size_t)i * stride + k];
+            }
+        }
+        GPU::memcpy(values, split.data(), sizeof(T) * count * planes);
     }
 
-    void finalize_dimension() {
-        Matrix::finalize_dimension();
-        swap_buffer = (double *)GPU::malloc(sizeof(double) * (row * col));
-        screen_buffer = (double *)malloc(sizeof(double) * row * col);
-        dirty = true;
+    // positions = positions * mat, mat must be affine
+    void multiply(const SmallMatrix<4, 4, T> &mat) {
+        T *device = (T *)GPU::malloc(sizeof(mat.values));
+        GPU::memcpy(device, (void *)mat.values, sizeof(mat.values));
+        GPU::transformPoints(count, values, device);
+        GPU::free(device);
     }
 
-    double at(int i, int j) {
-        if (dirty) {
-            GPU::memcpy(screen_buffer, values, sizeof(double) * (row * col),
-                        true);
-            dirty = false;
+#ifdef DEBUG
+    bool print() {
+        std::vector<T> h((size_t)count * planes);
+        GPU::memcpy(h.data(), values, sizeof(T) * count * planes, true);
+        for (int i = 0; i < count; i++) {
+            for (int k = 0; k < planes; k++) {
+                printf("%g ", (double)h[(size_t)k * count + i]);
+            }
+            printf("\n");
         }
-        return screen_buffer[i * col + j];
+        printf("\n");
+        return true;
     }
+#endif
 
     void destroy() {
         GPU::free(values);
-        GPU::free(swap_buffer);
-    }
-
-    ProjectionMatrix &operator*(const ConstantMatrix<4, 4> &mat2) {
-        multiply(mat2);
-        return *this;
+        values = NULL;
+        capacity = 0;
     }
 };
 
-struct Transform {
-    static ConstantMatrix<4, 4> translate(Point3D to) {
-        return ConstantMatrix<4, 4>(1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, to.x,
+typedef BasicVertexArray<real> VertexArray;
+
+template <typename T>
+struct BasicTransform {
+    static constexpr SmallMatrix<4, 4, T> translate(BasicPoint3D<T> to) {
+        return SmallMatrix<4, 4, T>(1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, to.x,
                                     to.y, to.z, 1);
     }
 
-    static ConstantMatrix<4, 4> rotate_x(const double angle) {
-        return ConstantMatrix<4, 4>(1, 0, 0, 0, 0, cos(angle), sin(angle), 0, 0,
-                                    -sin(angle), cos(angle), 0, 0, 0, 0, 1);
+    static SmallMatrix<4, 4, T> rotate_x(const double angle) {
+        return SmallMatrix<4, 4, T>(1, 0, 0, 0, 0, cos(angle), sin(angle), 0,
+                                    0, -sin(angle), cos(angle), 0, 0, 0, 0, 1);
     }
 
-    static ConstantMatrix<4, 4> rotate_y(const double angle) {
-        return ConstantMatrix<4, 4>(cos(angle), 0, -sin(angle), 0, 0, 1, 0, 0,
+    static SmallMatrix<4, 4, T> rotate_y(const double angle) {
+        return SmallMatrix<4, 4, T>(cos(angle), 0, -sin(angle), 0, 0, 1, 0, 0,
                                     sin(angle), 0, cos(angle), 0, 0, 0, 0, 1);
     }
 
-    static ConstantMatrix<4, 4> rotate_z(const double angle) {
-        return ConstantMatrix<4, 4>(cos(angle), sin(angle), 0, 0, -sin(angle),
+    static SmallMatrix<4, 4, T> rotate_z(const double angle) {
+        return SmallMatrix<4, 4, T>(cos(angle), sin(angle), 0, 0, -sin(angle),
                                     cos(angle), 0, 0, 0, 1, 0, 0, 0, 0, 0, 1);
     }
 
-    static ConstantMatrix<4, 4> scale(const double zoom) {
-        return ConstantMatrix<4, 4>(zoom, 0, 0, 0, 0, zoom, 0, 0, 0, 0, 0, zoom,
-                                    0, 0, 0, 1);
+    static constexpr SmallMatrix<4, 4, T> scale(const double zoom) {
+        return SmallMatrix<4, 4, T>(zoom, 0, 0, 0, 0, zoom, 0, 0, 0, 0, 0,
+                                    zoom, 0, 0, 0, 1);
     }
 };
+
+typedef BasicTransform<real> Transform;
+typedef SmallMatrix<4, 4> Mat4;
+typedef SmallMatrix<1, 4> Vec4;
@@ -0,0 +1,443 @@
+#include "mesh.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "profiler.h"
+#include "threadpool.h"
+
+// Parsed contents of one slice of the file. Face indices that refer to
+// vertices by position (positive obj indices) are final. Relative ones
+// (negative obj indices) are stored as local - RELATIVE, where local counts
+// from the first vertex of this chunk, and resolved once all chunks are known.
+// nonFinite counts the vertices with an inf or nan coordinate.
+struct ObjChunk {
+    const char *begin, *end;
+    std::vector<double> vertices;
+    std::vector<int> faces;
+    int nonFinite;
+};
+
+static const int RELATIVE = 1 << 30;
+
+// Layout of a .rmesh cache file: this header, then vertexCount * 4 doubles
+// at VERTEX_OFFSET, then faceCount * 3 ints right after them. The source
+// size and modification time tell whether the cache is stale.
+struct MeshCacheHeader {
+    char magic[4];
+    unsigned int version;
+    long long sourceSize, sourceMtime;
+    int vertexCount, faceCount;
+};
+
+static const char CACHE_MAGIC[4] = {'R', 'M', 'S', 'H'};
+static const unsigned int CACHE_VERSION = 2;
+static const size_t VERTEX_OFFSET = 64;
+static_assert(sizeof(MeshCacheHeader) <= VERTEX_OFFSET, "header too large");
+
+static inline bool isBlank(char c) { return c == ' ' || c == '\t'; }
+
+static inline const char *skipBlanks(const char *p, const char *end) {
+    while (p < end && isBlank(*p)) p++;
+    return p;
+}
+
+static const double POW10[] = {1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,
+                               1e7,  1e8,  1e9,  1e10, 1e11, 1e12, 1e13,
+                               1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20,
+                               1e21, 1e22};
+
+// Parses the decimal numbers found in obj files without strtod's locale
+// and generality. The fast path is exact only while the mantissa fits the
+// 53 bits of a double and the power of ten is exact too, so anything else
+// (long mantissas, inf, nan, huge exponents) is handed to strtod.
+static const char *parseDouble(const char *p, const char *end, double &out) {
+    const char *start = p;
+    bool negative = false;
+    if (p < end && (*p == '-' || *p == '+')) negative = *p++ == '-';
+
+    unsigned long long mantissa = 0;
+    int digits = 0, exponent = 0;
+    const char *integer = p;
+    for (; p < end && *p >= '0' && *p <= '9'; p++) {
+        if (digits < 19) {
+            mantissa = mantissa * 10 + (*p - '0');
+            if (mantissa) digits++;
+        } else {
+            exponent++;
+        }
+    }
+    bool sawDigit = p != integer;
+    if (p < end && *p == '.') {
+        for (p++; p < end && *p >= '0' && *p <= '9'; p++) {
+            sawDigit = true;
+            if (digits < 19) {
+                mantissa = mantissa * 10 + (*p - '0');
+                if (mantissa) digits++;
+                exponent--;
+            }
+        }
+    }
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        const char *q = p + 1;
+        bool negExp = false;
+        if (q < end && (*q == '-' || *q == '+')) negExp = *q++ == '-';
+        if (q < end && *q >= '0' && *q <= '9') {
+            int e = 0;
+            for (; q < end && *q >= '0' && *q <= '9'; q++) {
+                if (e < 10000) e = e * 10 + (*q - '0');
+            }
+            exponent += negExp ? -e : e;
+            p = q;
+        }
+    }
+
+    if (!sawDigit || mantissa > (1ULL << 53) || exponent < -22 ||
+        exponent > 22) {
+        // strtod needs a terminator, copy the token out
+        char token[64];
+        size_t len = 0;
+        while (start + len < end && len < sizeof(token) - 1 &&
+               !isBlank(start[len]) && start[len] != '\n' &&
+               start[len] != '\r') {
+            len++;
+        }
+        memcpy(token, start, len);
+        token[len] = 0;
+        char *stop;
+        out = strtod(token, &stop);
+        return start + (stop - token);
+    }
+
+    double value = (double)mantissa;
+    value = exponent < 0 ? value / POW10[-exponent] : value * POW10[exponent];
+    out = negative ? -value : value;
+    return p;
+}
+
+static inline const char *parseInt(const char *p, const char *end, int &out,
+                                   bool &valid) {
+    bool negative = false;
+    if (p < end && (*p == '-' || *p == '+')) negative = *p++ == '-';
+    const char *digits = p;
+    int value = 0;
+    for (; p < end && *p >= '0' && *p <= '9'; p++) {
+        value = value * 10 + (*p - '0');
+    }
+    valid = p != digits;
+    out = negative ? -value : value;
+    return p;
+}
+
+static void parseChunk(ObjChunk &chunk) {
+    const char *p = chunk.begin, *end = chunk.end;
+    int localVertices = 0;
+    chunk.nonFinite = 0;
+
+    while (p < end) {
+        const char *lineEnd = (const char *)memchr(p, '\n', end - p);
+        if (!lineEnd) lineEnd = end;
+
+        if (p + 1 < lineEnd && p[0] == 'v' && isBlank(p[1])) {
+            double xyz[3] = {0, 0, 0};
+            const char *q = p + 2;
+            for (int i = 0; i < 3; i++) {
+                q = skipBlanks(q, lineEnd);
+                q = parseDouble(q, lineEnd, xyz[i]);
+            }
+            if (!std::isfinite(xyz[0]) || !std::isfinite(xyz[1]) ||
+                !std::isfinite(xyz[2])) {
+                chunk.nonFinite++;
+            }
+            chunk.vertices.insert(chunk.vertices.end(),
+                                  {xyz[0], xyz[1], xyz[2], 1.0});
+            localVertices++;
+        } else if (p + 1 < lineEnd && p[0] == 'f' && isBlank(p[1])) {
+            // fan the polygon out into triangles as its corners come in
+            int count = 0, first = 0, previous = 0;
+            const char *q = skipBlanks(p + 2, lineEnd);
+            while (q < lineEnd && *q != '\r') {
+                int index;
+                bool valid;
+                q = parseInt(q, lineEnd, index, valid);
+                // skip the /vt/vn part of the token
+                while (q < lineEnd && !isBlank(*q)) q++;
+                q = skipBlanks(q, lineEnd);
+                if (!valid || index == 0) continue;
+                const int corner = index > 0
+                                       ? index - 1
+                                       : localVertices + index - RELATIVE;
+                if (count == 0) first = corner;
+                if (count >= 2) {
+                    chunk.faces.insert(chunk.faces.end(),
+                                       {first, previous, corner});
+                }
+                previous = corner;
+                count++;
+            }
+        }
+        p = lineEnd + 1;
+    }
+}
+
+MeshData::MeshData() {
+    mapping = NULL;
+    mappingSize = 0;
+    useVectors();
+}
+
+MeshData::~MeshData() { release(); }
+
+void MeshData::release() {
+    if (mapping) munmap(mapping, mappingSize);
+    mapping = NULL;
+    mappingSize = 0;
+}
+
+void MeshData::useVectors() {
+    vertexData = vertices.data();
+    faceData = faces.data();
+    vertexCount = vertices.size() / 4;
+    faceCount = faces.size() / 3;
+}
+
+static long long mtimeOf(const struct stat &st) {
+    return (long long)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+}
+
+bool MeshData::load(const char *file) {
+    struct stat st;
+    if (stat(file, &st) != 0) return false;
+
+    char cacheFile[4096];
+    snprintf(cacheFile, sizeof(cacheFile), "%s.rmesh", file);
+    if (loadCache(cacheFile, st.st_size, mtimeOf(st))) return true;
+
+    if (!loadObj(file)) return false;
+    optimize();
+    // a read-only directory just means every load parses
+    writeCache(cacheFile, st.st_size, mtimeOf(st));
+    return true;
+}
+
+bool MeshData::loadCache(const char *cacheFile, long long sourceSize,
+                         long long sourceMtime) {
+    PROFILE_SCOPE("loadCache");
+    int fd = open(cacheFile, O_RDONLY);
+    if (fd < 0) return false;
+
+    struct stat st;
+    MeshCacheHeader header;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < VERTEX_OFFSET ||
+        pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+        memcmp(header.magic, CACHE_MAGIC, 4) != 0 ||
+        header.version != CACHE_VERSION || header.sourceSize != sourceSize ||
+        header.sourceMtime != sourceMtime || header.vertexCount < 0 ||
+        header.faceCount < 0 ||
+        (size_t)st.st_size !=
+            VERTEX_OFFSET + sizeof(double) * 4 * header.vertexCount +
+                sizeof(int) * 3 * header.faceCount) {
+        close(fd);
+        return false;
+    }
+
+    void *mapped = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) return false;
+
+    // a damaged cache must not index past the vertices or hold coordinates
+    // the obj parser would have refused, parse again instead
+    const double *coordinates =
+        (const double *)((char *)mapped + VERTEX_OFFSET);
+    for (size_t i = 0; i < (size_t)header.vertexCount * 4; i++) {
+        if (!std::isfinite(coordinates[i])) {
+            munmap(mapped, st.st_size);
+            return false;
+        }
+    }
+    const int *indices = (const int *)((char *)mapped + VERTEX_OFFSET +
+                                       sizeof(double) * 4 * header.vertexCount);
+    for (size_t i = 0; i < (size_t)header.faceCount * 3; i++) {
+        if (indices[i] < 0 || indices[i] >= header.vertexCount) {
+            munmap(mapped, st.st_size);
+            return false;
+        }
+    }
+
+    release();
+    vertices.clear();
+    faces.clear();
+    mapping = mapped;
+    mappingSize = st.st_size;
+    vertexData = (const double *)((char *)mapped + VERTEX_OFFSET);
+    faceData = (const int *)(vertexData + 4 * (size_t)header.vertexCount);
+    vertexCount = header.vertexCount;
+    faceCount = header.faceCount;
+    return true;
+}
+
+void MeshData::tempName(char *out, size_t size, const char *file) {
+    static std::atomic<int> written(0);
+    snprintf(out, size, "%s.%d.%d.tmp", file, (int)getpid(), written++);
+}
+
+bool MeshData::writeCache(const char *cacheFile, long long sourceSize,
+                          long long sourceMtime) const {
+    PROFILE_SCOPE("writeCache");
+    // write next to the target and rename, so readers never see half a file
+    char tmpFile[4096 + 32];
+    tempName(tmpFile, sizeof(tmpFile), cacheFile);
+    FILE *f = fopen(tmpFile, "wb");
+    if (f == NULL) return false;
+
+    MeshCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CACHE_MAGIC, 4);
+    header.version = CACHE_VERSION;
+    header.sourceSize = sourceSize;
+    header.sourceMtime = sourceMtime;
+    header.vertexCount = vertexCount;
+    header.faceCount = faceCount;
+    char pad[VERTEX_OFFSET] = {0};
+    memcpy(pad, &header, sizeof(header));
+
+    bool ok = fwrite(pad, VERTEX_OFFSET, 1, f) == 1;
+    if (vertexCount) {
+        ok = ok && fwrite(vertexData, sizeof(double) * 4, vertexCount, f) ==
+                       (size_t)vertexCount;
+    }
+    if (faceCount) {
+        ok = ok && fwrite(faceData, sizeof(int) * 3, faceCount, f) ==
+                       (size_t)faceCount;
+    }
+    ok = fclose(f) == 0 && ok;
+    if (!ok || rename(tmpFile, cacheFile) != 0) {
+        unlink(tmpFile);
+        return false;
+    }
+    return true;
+}
+
+bool MeshData::loadObj(const char *file) {
+    PROFILE_SCOPE("parseObj");
+    int fd = open(file, O_RDONLY);
+    if (fd < 0) return false;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return false;
+    }
+    size_t size = st.st_size;
+    release();
+    vertices.clear();
+    faces.clear();
+    if (size == 0) {
+        close(fd);
+        useVectors();
+        return true;
+    }
+
+    void *mapped = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) return false;
+    madvise(mapped, size, MADV_SEQUENTIAL);
+    const char *data = (const char *)mapped;
+    const char *end = data + size;
+
+    // cut the file into line aligned chunks of at least 256KiB
+    const size_t MIN_CHUNK = 256 * 1024;
+    size_t chunkCount = ThreadPool::size() * 4;
+    if (size / chunkCount < MIN_CHUNK) chunkCount = size / MIN_CHUNK + 1;
+    std::vector<ObjChunk> chunks(chunkCount);
+    const char *p = data;
+    for (size_t i = 0; i < chunkCount; i++) {
+        chunks[i].begin = p;
+        const char *target = data + size * (i + 1) / chunkCount;
+        if (target < p) target = p;
+        if (i + 1 < chunkCount && target < end) {
+            const char *nl = (const char *)memchr(target, '\n', end - target);
+            p = nl ? nl + 1 : end;
+        } else {
+            p = end;
+        }
+        chunks[i].end = p;
+    }
+
+    ThreadPool::parallel_for(chunkCount, 1, [&](int begin, int finish) {
+        for (int i = begin; i < finish; i++) parseChunk(chunks[i]);
+    });
+    munmap(mapped, size);
+
+    // the mesh optimizer and simplifier sort vertices by position, which
+    // nan can't be ordered by, and inf has no place on screen either
+    int nonFinite = 0;
+    for (size_t i = 0; i < chunkCount; i++) nonFinite += chunks[i].nonFinite;
+    if (nonFinite) {
+        printf("[Error] %s has %d vertices with inf or nan coordinates\n",
+               file, nonFinite);
+        useVectors();
+        return false;
+    }
+
+    // every chunk's slot in the final arrays
+    std::vector<size_t> vertexOffset(chunkCount + 1, 0),
+        faceOffset(chunkCount + 1, 0);
+    for (size_t i = 0; i < chunkCount; i++) {
+        vertexOffset[i + 1] = vertexOffset[i] + chunks[i].vertices.size();
+        faceOffset[i + 1] = faceOffset[i] + chunks[i].faces.size();
+    }
+    vertices.resize(vertexOffset[chunkCount]);
+    faces.resize(faceOffset[chunkCount]);
+    const int vertexTotal = vertexOffset[chunkCount] / 4;
+
+    std::vector<int> dropped(chunkCount, 0);
+    ThreadPool::parallel_for(chunkCount, 1, [&](int begin, int finish) {
+        for (int i = begin; i < finish; i++) {
+            ObjChunk &chunk = chunks[i];
+            memcpy(&vertices[vertexOffset[i]], chunk.vertices.data(),
+                   sizeof(double) * chunk.vertices.size());
+            int base = vertexOffset[i] / 4;
+            int *out = &faces[faceOffset[i]];
+            for (size_t f = 0; f < chunk.faces.size(); f += 3) {
+                int tri[3];
+                bool valid = true;
+                for (int j = 0; j < 3; j++) {
+                    int index = chunk.faces[f + j];
+                    if (index < 0) index = base + index + RELATIVE;
+                    valid = valid && index >= 0 && index < vertexTotal;
+                    tri[j] = index;
+                }
+                if (!valid) {
+                    dropped[i]++;
+                    continue;
+                }
+                out[0] = tri[0];
+                out[1] = tri[1];
+                out[2] = tri[2];
+                out += 3;
+            }
+        }
+    });
+
+    // close the gaps left by faces with out of range indices
+    size_t write = 0;
+    for (size_t i = 0; i < chunkCount; i++) {
+        size_t kept = chunks[i].faces.size() - dropped[i] * 3;
+        if (write != faceOffset[i]) {
+            memmove(&faces[write], &faces[faceOffset[i]], sizeof(int) * kept);
+        }
+        write += kept;
+    }
+    faces.resize(write);
+    useVectors();
+    return true;
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <stddef.h>
+
+#include <vector>
+
+// A simplified copy of a mesh, see MeshData::simplify
+struct MeshLevel {
+    std::vector<double> vertices;  // x, y, z, 1 like MeshData::vertices
+    std::vector<int> faces;
+    std::vector<int> source;  // the MeshData vertex each one was kept from
+    double error;  // upper bound on how far the surface moved, model units
+};
+
+// Mesh data on the host, as read from disk and before it is uploaded to the
+// compute backend. It is either parsed into the vectors or mapped straight
+// from a binary cache file; vertexData and faceData point at whichever one
+// holds the mesh.
+struct MeshData {
+    // x, y, z, 1 for every vertex, laid out like the vertices matrix
+    std::vector<double> vertices;
+    // three vertex indices per triangle, polygons are fanned out
+    std::vector<int> faces;
+
+    const double *vertexData;
+    const int *faceData;
+    int vertexCount, faceCount;
+
+    MeshData();
+    ~MeshData();
+    MeshData(const MeshData &) = delete;
+    MeshData &operator=(const MeshData &) = delete;
+
+    // Loads from the sidecar cache (file + ".rmesh") when it is still valid
+    // for file, otherwise parses file and writes a fresh cache.
+    bool load(const char *file);
+
+    // Parses the v and f lines of an obj file. The file is mapped into
+    // memory and split into chunks that are parsed in parallel.
+    bool loadObj(const char *file);
+
+    // Welds vertices at the same position and reorders the faces and
+    // vertices for reuse, see reorder(). Done before the mesh is cached.
+    void optimize();
+    // Reorders faces for a small vertex cache (Tipsify) and renumbers the
+    // vertices in the order the faces first use them, dropping unused ones.
+    // source, when given, is permuted along with the vertices.
+    static void reorder(std::vector<double> &vertices, std::vector<int> &faces,
+                        std::vector<int> *source);
+    // Average vertex cache misses per face the faces cause, lower is better
+    static double acmr(const std::vector<int> &faces, int vertexCount);
+
+    // A name next to file for writing it before renaming it into place, one
+    // that no other thread or process is writing to
+    static void tempName(char *out, size_t size, const char *file);
+
+    // Builds a chain of levels of detail by quadric error edge collapse,
+    // each with at most half the faces of the one before, down to about
+    // minFaces. Stops early where collapsing further would tear the surface.
+    void simplify(std::vector<MeshLevel> &levels, int minFaces) const;
+    // simplify(), cached in a sidecar file (file + ".rlod") like load()
+    void loadLevels(const char *file, std::vector<MeshLevel> &levels,
+                    int minFaces) const;
+
+   private:
+    void *mapping;
+    size_t mappingSize;
+
+    void release();
+    void useVectors();
+    bool loadCache(const char *cacheFile, long long sourceSize,
+                   long long sourceMtime);
+    bool writeCache(const char *cacheFile, long long sourceSize,
+                    long long sourceMtime) const;
+};
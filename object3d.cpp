@@ -1,195 +1,408 @@
 #include "object3d.h"
 
+#include <limits.h>
+#include <string.h>
 #include <time.h>
 
+#include <algorithm>
+#include <random>
+
+#include "allocator.h"
+#include "mesh.h"
 #include "renderer.h"
+#include "threadpool.h"
+
+// GPU::transform addresses the positions of the vertices in floats
+static_assert(sizeof(SDL_Vertex) % sizeof(float) == 0,
+              "SDL_Vertex is not a whole number of floats");
+
+Instance::Instance() {
+    model = Mat4::identity();
+    color = {255, 255, 255, 255};
+}
+
+Instance Instance::place(Point3D position, double yaw, double scale,
+                         SDL_Color color) {
+    Instance inst;
+    const Mat4 scaling(scale, 0, 0, 0, 0, scale, 0, 0, 0, 0, scale, 0, 0, 0,
+                       0, 1);
+    inst.model = scaling * Transform::rotate_y(yaw) *
+                 Transform::translate(position);
+    inst.color = color;
+    return inst;
+}
+
+void Object3D::swap(Object3D &other) noexcept {
+    std::swap(renderer, other.renderer);
+    std::swap(file, other.file);
+    vertices.swap(other.vertices);
+    std::swap(model, other.model);
+    std::swap(faces_row, other.faces_row);
+    faces.swap(other.faces);
+    std::swap(center, other.center);
+    std::swap(radius, other.radius);
+    lods.swap(other.lods);
+    instances.swap(other.instances);
+    std::swap(plot_points, other.plot_points);
+    std::swap(frames, other.frames);
+    std::swap(shown, other.shown);
+    std::swap(version, other.version);
+    std::swap(clipW, other.clipW);
+    std::swap(vertexColors, other.vertexColors);
+    std::swap(preparedInstances, other.preparedInstances);
+    std::swap(instancesChanged, other.instancesChanged);
+}
 
 void Object3D::movement() { rotate_y(fmod((double)SDL_GetTicks64(), 0.005)); }
-void Object3D::prepare() {
-    projectionMatrix = ProjectionMatrix(vertices.row, 4);
+void Object3D::prepare(unsigned colorSeed) {
     plot_points =
         (SDL_Point *)malloc(sizeof(SDL_Point) * (faces_row * FACES_COL));
-    sdl_vertices =
-        (SDL_Vertex *)malloc(sizeof(SDL_Vertex) * faces_row * FACES_COL);
-    randomFaceColors =
-        (Uint8 *)malloc(sizeof(Uint8) * faces_row * FACES_COL * 3);
-    srand(time(NULL));
-    for (int i = 0; i < faces_row; i++) {
-        randomFaceColors[i * FACES_COL] = rand() % 255;
-        randomFaceColors[i * FACES_COL + 1] = rand() % 255;
-        randomFaceColors[i * FACES_COL + 2] = rand() % 255;
+    vertexColors = (Uint8 *)malloc(sizeof(Uint8) * 3 * vertices.count);
+    // a generator of its own, objects may be loaded on several threads
+    std::minstd_rand random(colorSeed);
+    for (int i = 0; i < vertices.count * 3; i++) {
+        vertexColors[i] = (Uint8)(random() % 255);
     }
+    // the per instance buffers are sized on the first frame
+    preparedInstances = 0;
+    instancesChanged = true;
 }
 
-void Object3D::screenProjection(bool dumpMatrices) {
-    (void)dumpMatrices;
-#ifdef DEBUG
-    if (dumpMatrices) {
-        printf("vertices:\n");
-        vertices.print();
-        printf("cameraMatrix:\n");
-        renderer->camera.cameraMatrix().print();
+// every level is no larger than level 0, so neither is any mix of them. A
+// face clipped by the near plane adds up to two vertices and becomes up to
+// two triangles.
+static size_t vertexCapacity(const Object3D &o, size_t instances) {
+    return ((size_t)o.vertices.count + (size_t)o.faces_row * 2) * instances;
+}
+
+static size_t indexCapacity(const Object3D &o, size_t instances) {
+    return (size_t)o.faces_row * Object3D::FACES_COL * 2 * instances;
+}
+
+int Object3D::maxInstances() const {
+    const size_t perInstance =
+        std::max(vertexCapacity(*this, 1), indexCapacity(*this, 1));
+    return perInstance > 0 ? INT_MAX / perInstance : INT_MAX;
+}
+
+bool Object3D::prepareInstances() {
+    if ((int)instances.size() > maxInstances()) {
+        printf("[Error] %zu instances of %s are more than SDL can index, "
+               "drawing %d\n",
+               instances.size(), file, maxInstances());
+        instances.resize(maxInstances());
     }
-#endif
-    projectionMatrix.multiply_and_assign(vertices,
-                                         renderer->camera.cameraMatrix());
-#ifdef DEBUG
-    if (dumpMatrices) {
-        printf("vertices * cameraMatrix:\n");
-        projectionMatrix.print();
-        printf("projection_matrix:\n");
-        renderer->projection.projection_matrix.print();
+    const int n = instances.size();
+    if (!instancesChanged && n == preparedInstances) return false;
+    if (n != preparedInstances) {
+        const size_t vertexCount = vertexCapacity(*this, n);
+        for (Frame &frame : frames) {
+            free(frame.sdl_vertices);
+            free(frame.sdl_depths);
+            free(frame.sdl_indices);
+            frame.sdl_vertices =
+                (SDL_Vertex *)malloc(sizeof(SDL_Vertex) * vertexCount);
+            frame.sdl_depths = (float *)malloc(sizeof(float) * vertexCount);
+            frame.sdl_indices =
+                (int *)malloc(sizeof(int) * indexCapacity(*this, n));
+            // positions are written every frame, colours whenever the level
+            // or the tint of an instance changes
+            for (size_t i = 0; i < vertexCount; i++) {
+                frame.sdl_vertices[i].tex_coord = {1.0, 1.0};
+            }
+        }
+        free(clipW);
+        clipW = (float *)malloc(sizeof(float) * vertices.count * n);
+        preparedInstances = n;
     }
-#endif
-    projectionMatrix.multiply(renderer->projection.projection_matrix);
-#ifdef DEBUG
-    if (dumpMatrices) {
-        printf("vertices * cameraMatrix * projection_matrix:\n");
-        projectionMatrix.print();
+    for (Frame &frame : frames) {
+        frame.vertexCount = frame.indexCount = 0;
+        frame.painted.clear();
     }
-#endif
-    projectionMatrix.normalizeAndCutoff();
+    shown[0] = shown[1] = -1;
+    instancesChanged = false;
+    return true;
+}
+
+int Object3D::selectLevel(const Mat4 &instanceModel,
+                          const Mat4 &clipMatrix) const {
+    if (lods.empty() || !renderer->useLod || radius <= 0) return 0;
+    // the longest axis of the instance in the world, the camera keeps sizes
+    const Mat4 world = instanceModel * model;
+    double scale = 0;
+    for (int r = 0; r < 3; r++) {
+        const double x = world.at(r, 0), y = world.at(r, 1),
+                     z = world.at(r, 2);
+        scale = fmax(scale, sqrt(x * x + y * y + z * z));
+    }
+    const Vec4 clip =
+        Vec4(center.x, center.y, center.z, 1) * (instanceModel * clipMatrix);
+    const double w = clip.at(3), r = radius * scale;
+    // the camera is inside the sphere or right at it
+    if (w <= r) return 0;
+    // radius of the bounding sphere on screen, in pixels
+    const double projected = r * renderer->projection.projection_matrix.at(0) *
+                             renderer->H_WIDTH / w;
+    for (int l = lods.size(); l > 0; l--) {
+        if (lods[l - 1].error / radius * projected <= LOD_PIXEL_ERROR) {
+            return l;
+        }
+    }
+    return 0;
+}
+
+bool Object3D::project(int slot, bool dumpMatrices) {
+    const int other = shown[slot ^ 1];
+    const Uint64 view = renderer->viewVersion();
+    if (other >= 0 && !renderer->animate &&
+        frames[other].modelVersion == version &&
+        frames[other].viewVersion == view) {
+        shown[slot] = other;
+        return false;
+    }
+    // not the frame the other slot shows, it may be on screen right now
+    const int target = other >= 0 ? other ^ 1 : slot;
+    screenProjection(target, dumpMatrices);
+    frames[target].modelVersion = version;
+    frames[target].viewVersion = view;
+    shown[slot] = target;
+    if (renderer->animate) movement();
+    return true;
+}
+
+void Object3D::screenProjection(int target, bool dumpMatrices) {
+    (void)dumpMatrices;
+    PROFILE_SCOPE("screenProjection");
+    Frame &frame = frames[target];
+    frame.vertexCount = frame.indexCount = 0;
+    const int n = instances.size();
+    // prepareInstances() has to run first, on the thread owning the scene
+    if (n == 0 || vertices.count == 0 || n != preparedInstances) return;
+
+    PROFILE_START(compose);
+    // all on the host: compose the 4x4s once, so the vertices are only
+    // walked a single time, then once more per instance. Only the results
+    // go to the backend, in one transfer.
+    const Mat4 clipMatrix = model * renderer->camera.cameraMatrix() *
+                            renderer->projection.projection_matrix;
+    // instances sorted by level, so each level is one batched transform
+    const int levels = lods.size() + 1;
+    std::vector<int> levelOf(n), order(n), first(levels + 1, 0);
+    for (int k = 0; k < n; k++) {
+        levelOf[k] = selectLevel(instances[k].model, clipMatrix);
+        first[levelOf[k] + 1]++;
+    }
+    for (int l = 0; l < levels; l++) first[l + 1] += first[l];
+    std::vector<int> next(first.begin(), first.end() - 1);
+    for (int k = 0; k < n; k++) order[next[levelOf[k]]++] = k;
+    std::vector<Mat4> matrices(n + 1);
+    matrices[0] = renderer->projection.to_screen_matrix;
+    for (int j = 0; j < n; j++) {
+        matrices[j + 1] = instances[order[j]].model * clipMatrix;
+    }
+    // only needed for this frame
+    real *frameMatrices = (real *)Allocator::scratch(sizeof(Mat4) * (n + 1));
+    GPU::memcpy(frameMatrices, matrices.data(), sizeof(Mat4) * (n + 1));
+    PROFILE_END(compose);
 #ifdef DEBUG
     if (dumpMatrices) {
-        printf("vertices.normalizeAndCutoff():\n");
-        projectionMatrix.print();
+        printf("vertices:\n");
+        vertices.print();
+        printf("model * cameraMatrix * projection_matrix:\n");
+        clipMatrix.print();
         printf("to_screen_matrix:\n");
         renderer->projection.to_screen_matrix.print();
     }
 #endif
-    projectionMatrix.multiply(renderer->projection.to_screen_matrix);
+    // nothing written yet since the buffers were made
+    frame.painted.resize(n, {-1, -1, {0, 0, 0, 0}});
+    int vertexBase = 0;
+    for (int l = 0; l < levels; l++) {
+        const int m = first[l + 1] - first[l];
+        if (m == 0) continue;
+        const VertexArray &levelVertices = l ? lods[l - 1].vertices : vertices;
+        const int *levelFaces = l ? lods[l - 1].faces.data() : faces.data();
+        const int levelFaceCount = l ? lods[l - 1].faces_row : faces_row;
+        const Uint8 *colors = l ? lods[l - 1].colors.data() : vertexColors;
+        const int *ids = &order[first[l]];
+        const int perInstance = levelVertices.count;
+        const int count = perInstance * m;
+        SDL_Vertex *sdl_vertices = frame.sdl_vertices + vertexBase;
+        float *sdl_depths = frame.sdl_depths + vertexBase;
+
+        PROFILE_START(transform);
+        // positions and depths straight into the frame, w only for culling
+        const ScreenOutput out = {&sdl_vertices[0].position.x,
+                                  sizeof(SDL_Vertex) / sizeof(float),
+                                  sdl_depths, clipW};
+        GPU::transform(perInstance, m, levelVertices.values,
+                       frameMatrices + 16 * (1 + first[l]), frameMatrices,
+                       out);
+        Profiler::count(Profiler::VERTICES, count);
+        PROFILE_END(transform);
 #ifdef DEBUG
-    if (dumpMatrices) {
-        printf(
-            "(vertices * cameraMatrix * projectionMatrix).normalizeAndCutoff() "
-            "* to_screen_matrix:\n");
-        projectionMatrix.print();
-        // faces.print();
-    }
+        if (dumpMatrices) {
+            printf(
+                "(vertices * instance * model * cameraMatrix * "
+                "projectionMatrix).normalize() * to_screen_matrix and clip "
+                "w, level %d:\n",
+                l);
+            for (int i = 0; i < count; i++) {
+                printf("%g %g %g %g\n", sdl_vertices[i].position.x,
+                       sdl_vertices[i].position.y, sdl_depths[i], clipW[i]);
+            }
+            printf("\n");
+        }
 #endif
-    MEASURE_START(drawLines);
-    Uint8 *faceColor = randomFaceColors;
-    int pointCount = 0;
-    for (int i = 0; i < faces_row; i++) {
-        const int *face = &faces.data()[i * FACES_COL];
-        int bakPointCount = pointCount;
-        for (int j = 0; j < FACES_COL; j++) {
-            double px = projectionMatrix.at(face[j], 0);
-            double py = projectionMatrix.at(face[j], 1);
-            if (px == renderer->H_WIDTH || py == renderer->H_HEIGHT) {
-                pointCount = bakPointCount;
-                break;
+        PROFILE_START(gather);
+        // the vertex colours of every instance, tinted, unless this frame
+        // still holds them from the last time it was projected
+        std::vector<int> stale;
+        for (int j = 0; j < m; j++) {
+            const SDL_Color tint = instances[ids[j]].color;
+            Painted &had = frame.painted[first[l] + j];
+            if (had.offset == vertexBase + j * perInstance && had.level == l &&
+                had.tint.r == tint.r && had.tint.g == tint.g &&
+                had.tint.b == tint.b) {
+                continue;
             }
-            sdl_vertices[pointCount].position = {(float)px, (float)py};
-            sdl_vertices[pointCount].color = {*faceColor, *(faceColor + 1),
-                                              *(faceColor + 2), 255};
-            sdl_vertices[pointCount].tex_coord = {1.0, 1.0};
-            // if (dumpMatrices)
-            //    printf("%g %d %d\n", face[j], plot_points[pointCount].x,
-            //           plot_points[pointCount].y);
-            pointCount++;
+            had = {vertexBase + j * perInstance, l, tint};
+            stale.push_back(j);
         }
-        faceColor += 3;
+        ThreadPool::parallel_for(
+            stale.size() * perInstance, 4096, [&](int begin, int end) {
+                int s = begin / perInstance, v = begin - s * perInstance;
+                SDL_Vertex *out = &sdl_vertices[stale[s] * perInstance];
+                SDL_Color tint = instances[ids[stale[s]]].color;
+                for (int i = begin; i < end; i++) {
+                    const Uint8 *c = &colors[v * 3];
+                    out[v].color = {(Uint8)(c[0] * tint.r / 255),
+                                    (Uint8)(c[1] * tint.g / 255),
+                                    (Uint8)(c[2] * tint.b / 255), 255};
+                    if (++v == perInstance && ++s < (int)stale.size()) {
+                        v = 0;
+                        out = &sdl_vertices[stale[s] * perInstance];
+                        tint = instances[ids[stale[s]]].color;
+                    }
+                }
+            });
+        PROFILE_END(gather);
+        int extraCount;
+        int *indices = frame.sdl_indices + frame.indexCount;
+        const int indexCount = renderer->culler.run(
+            clipW, levelFaces, levelFaceCount, perInstance, m, sdl_vertices,
+            sdl_depths, indices, &extraCount);
+        // the culler counts from the start of this level
+        if (vertexBase) {
+            for (int i = 0; i < indexCount; i++) indices[i] += vertexBase;
+        }
+        frame.indexCount += indexCount;
+        frame.vertexCount = vertexBase + count + extraCount;
+        vertexBase += count + levelFaceCount * 2 * m;
     }
-    SDL_RenderGeometry(renderer->renderer, NULL, sdl_vertices, pointCount, NULL,
-                       0);
-    MEASURE_END(drawLines);
     /*
-    MEASURE_START(drawPoints);
+    PROFILE_START(drawPoints);
     for (int i = 0; i < projectionMatrix.row; i++) {
         double x = projectionMatrix.at(i, 0);
         double y = projectionMatrix.at(i, 1);
         if (x == renderer->H_WIDTH || y == renderer->H_HEIGHT) continue;
         SDL_RenderDrawPoint(renderer->renderer, x, y);
     }
-    MEASURE_END(drawPoints);
+    PROFILE_END(drawPoints);
     */
 }
 
+void Object3D::submit(int slot) {
+    if (shown[slot] < 0) return;
+    const Frame &frame = frames[shown[slot]];
+    if (frame.indexCount == 0) return;
+    PROFILE_SCOPE("submit");
+    if (renderer->useRasterizer) {
+        renderer->rasterizer.draw(frame.sdl_vertices, frame.sdl_depths,
+                                  frame.sdl_indices, frame.indexCount);
+    } else {
+        SDL_RenderGeometry(renderer->renderer, NULL, frame.sdl_vertices,
+                           frame.vertexCount, frame.sdl_indices,
+                           frame.indexCount);
+    }
+    Profiler::count(Profiler::TRIANGLES, frame.indexCount / FACES_COL);
+}
+
 Object3D Object3D::loadObj(const char *file, Renderer *r) {
+    return loadObj(file, r, time(NULL));
+}
+
+Object3D Object3D::loadObj(const char *file, Renderer *r,
+                           unsigned colorSeed) {
+    PROFILE_SCOPE("loadObj");
+    const char *fallback = "obj/cat.obj";
     if (file == NULL) {
-        return loadObj("obj/cat.obj", r);
+        file = fallback;
     }
-    FILE *f = fopen(file, "r");
-    if (f == NULL) {
-        printf("[Error] Cannot load obj file from: %s", file);
-        return loadObj("obj/cat.obj", r);
+    MeshData mesh;
+    if (!mesh.load(file)) {
+        printf("[Error] Cannot load obj file from: %s\n", file);
+        if (strcmp(file, fallback) != 0) {
+            return loadObj(fallback, r, colorSeed);
+        }
+        // not even the fallback is there, carry on with an empty object
     }
 
-    fseek(f, 0, SEEK_END);
-    long size = ftell(f);
-    char *buffer = (char *)malloc(size + 1);
-    char *bak = buffer;
-    fseek(f, 0, SEEK_SET);
-    fread(buffer, size, 1, f);
-    buffer[size] = 0;
-    fclose(f);
-
     Object3D obj;
     obj.renderer = r;
-    obj.vertices.col = 4;
-
-    // int vcount = 0, fcount = 0;
-    while (*buffer) {
-        if (*buffer == 'v' && *(buffer + 1) == ' ') {
-            buffer++;  // v
-            buffer++;  // ' '
-            double x = strtod(buffer, &buffer);
-            double y = strtod(buffer, &buffer);
-            double z = strtod(buffer, &buffer);
-            // printf("vertex %d: %f %f %f\n", vcount++, x, y, z);
-            obj.vertices.appendRow(x, y, z, 1.0);
-        } else if (*buffer == 'f' && *(buffer + 1) == ' ') {
-            buffer++;  // f
-            buffer++;  // ' '
-            int f1 = strtol(buffer, &buffer, 10) - 1;
-            // should stop at '/', proceed until next ' '
-            while (*buffer++ != ' ')
-                ;
-            int f2 = strtol(buffer, &buffer, 10) - 1;
-            // should stop at '/', proceed until next ' '
-            while (*buffer++ != ' ')
-                ;
-            int f3 = strtol(buffer, &buffer, 10) - 1;
-            // should stop at '/', proceed until next ' '
-            while (*buffer != ' ' && *buffer != '\n') {
-                buffer++;
-            }
-            // printf("%d\n", *buffer);
-            if (*buffer == '\n' || (*buffer == ' ' && *(buffer + 1) == '\n')) {
-                // we don't have 4th vertex
-                // printf("face %d: %d %d %d\n", fcount++, f1, f2, f3);
-                obj.faces.push_back(f1);
-                obj.faces.push_back(f2);
-                obj.faces.push_back(f3);
-                // if (obj.faces_col == 4) {
-                //    obj.faces.push_back(f3);
-                // }
-                obj.faces_row++;
-            } else {
-                // printf("4\n");
-                int f4 = strtol(buffer, &buffer, 10) - 1;
-                if (f4 == -1) f4 = f3;
-                // printf("face %d: %d %d %d %d\n", fcount++, f1, f2, f3, f4);
-                obj.faces.push_back(f1);
-                obj.faces.push_back(f2);
-                obj.faces.push_back(f3);
-                // break the quad into triangles
-                obj.faces.push_back(f1);
-                obj.faces.push_back(f3);
-                obj.faces.push_back(f4);
-                obj.faces_row++;
-                obj.faces_row++;
-            }
+    obj.file = file;
+    obj.vertices.planes = 3;
+    PROFILE_START(upload);
+    // split into planes on the host, then one transfer to the device
+    obj.vertices.assign(mesh.vertexData, mesh.vertexCount, 4);
+    PROFILE_END(upload);
+    obj.faces_row = mesh.faceCount;
+    obj.faces.assign(mesh.faceData, mesh.faceData + mesh.faceCount * FACES_COL);
+
+    // bounding sphere around the centre of the bounding box, for placing
+    // instances next to each other
+    double lo[3] = {0, 0, 0}, hi[3] = {0, 0, 0};
+    for (int i = 0; i < mesh.vertexCount; i++) {
+        const double *v = &mesh.vertexData[i * 4];
+        for (int k = 0; k < 3; k++) {
+            if (i == 0 || v[k] < lo[k]) lo[k] = v[k];
+            if (i == 0 || v[k] > hi[k]) hi[k] = v[k];
+        }
+    }
+    obj.center = Point3D((lo[0] + hi[0]) / 2, (lo[1] + hi[1]) / 2,
+                         (lo[2] + hi[2]) / 2);
+    double radius2 = 0;
+    for (int i = 0; i < mesh.vertexCount; i++) {
+        const double *v = &mesh.vertexData[i * 4];
+        double dx = v[0] - obj.center.x, dy = v[1] - obj.center.y,
+               dz = v[2] - obj.center.z;
+        radius2 = fmax(radius2, dx * dx + dy * dy + dz * dz);
+    }
+    obj.radius = sqrt(radius2);
+
+    obj.prepare(colorSeed);
+
+    // coarser copies for when instances are far away, colored like the
+    // vertices they were kept from
+    std::vector<MeshLevel> levels;
+    mesh.loadLevels(file, levels, MIN_LOD_FACES);
+    obj.lods.resize(levels.size());
+    for (size_t l = 0; l < levels.size(); l++) {
+        const MeshLevel &level = levels[l];
+        Lod &lod = obj.lods[l];
+        lod.vertices.planes = 3;
+        lod.vertices.assign(level.vertices.data(), level.source.size(), 4);
+        lod.faces = level.faces;
+        lod.faces_row = level.faces.size() / FACES_COL;
+        lod.error = level.error;
+        lod.colors.reserve(level.source.size() * 3);
+        for (size_t i = 0; i < level.source.size(); i++) {
+            const Uint8 *c = &obj.vertexColors[level.source[i] * 3];
+            lod.colors.insert(lod.colors.end(), c, c + 3);
         }
-        // skip line
-        while (*buffer++ != '\n')
-            ;
     }
-    free(bak);
 
-    obj.vertices.finalize_dimension();
-    obj.prepare();
+    obj.addInstance(Instance());
 
     return obj;
 }
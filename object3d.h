@@ -1,5 +1,7 @@
 #pragma once
 
+#include <SDL2/SDL.h>
+
 #include <vector>
 
 #include "matrix.h"
@@ -8,50 +10,212 @@ struct Renderer;
 struct SDL_Point;
 struct SDL_Vertex;
 
+// One placement of an Object3D's mesh. The mesh itself is shared, an
+// instance only says where it goes and how it is tinted.
+struct Instance {
+    Mat4 model;       // vertices are transformed as v * model
+    SDL_Color color;  // multiplies the mesh's vertex colours
+
+    // identity, untinted
+    Instance();
+    // scaled by scale, turned by yaw around y, then moved to position
+    static Instance place(Point3D position, double yaw, double scale,
+                          SDL_Color color);
+};
+
 struct Object3D {
     Renderer *renderer;
-    ProjectionMatrix vertices;
+    const char *file;
+    // x, y and z planes, uploaded once by loadObj and never written again,
+    // so the mesh can be shared
+    VertexArray vertices;
+    // places the object, with all its instances, in the world. Composed into
+    // the camera and projection every frame instead of moving the vertices.
+    Mat4 model;
     const static int FACES_COL = 3;
     int faces_row;
     std::vector<int> faces;
-    ProjectionMatrix projectionMatrix;  // vertex.row * 4
+    // bounding sphere of the mesh
+    Point3D center;
+    real radius;
+
+    // Simplified copies of the mesh, made by MeshData::simplify when it is
+    // loaded. Level 0 is vertices and faces above, level l > 0 is
+    // lods[l - 1], each with about half the faces of the level before.
+    struct Lod {
+        VertexArray vertices;
+        std::vector<int> faces;
+        int faces_row;
+        real error;  // how far the surface may have moved, in model units
+        std::vector<Uint8> colors;  // rgb per vertex, taken from level 0
+    };
+    std::vector<Lod> lods;
+    // instances are drawn at the coarsest level that keeps the error below
+    // this many pixels on screen
+    constexpr static double LOD_PIXEL_ERROR = 0.5;
+    // no level gets fewer faces than this
+    const static int MIN_LOD_FACES = 256;
+
+    // every instance is drawn by the same batched transform, instance k as
+    // vertices * instances[k].model * model
+    std::vector<Instance> instances;
+
     SDL_Point *plot_points;
-    SDL_Vertex *sdl_vertices;
-    Uint8 *randomFaceColors;
 
-    Object3D() { faces_row = 0; }
-    void prepare();
+    // Where an instance's colours sit in a Frame's sdl_vertices, and the
+    // level and tint they were written for
+    struct Painted {
+        int offset, level;
+        SDL_Color tint;
+    };
+    // What project() leaves for submit(). There are two, so the next frame
+    // is projected into one while the other is drawn.
+    struct Frame {
+        // the vertices of every instance, at its level, then the ones near
+        // plane clipping made for them. Then the next level, and so on.
+        SDL_Vertex *sdl_vertices;
+        float *sdl_depths;  // depth of each sdl_vertices entry, for Rasterizer
+        int *sdl_indices;   // the visible faces, indexing sdl_vertices
+        int vertexCount, indexCount;
+        // version and Renderer::viewVersion() it was projected at
+        Uint64 modelVersion, viewVersion;
+        // the colours last written, in the order screenProjection() puts
+        // the instances in, so the ones still right are left alone
+        std::vector<Painted> painted;
+    };
+    static const int FRAME_SLOTS = 2;
+    Frame frames[FRAME_SLOTS];
+    // the frame drawn for each FramePipeline slot, -1 for none. Both slots
+    // show the same frame for as long as nothing changes.
+    int shown[FRAME_SLOTS];
+    // bumped whenever model or the instances change, see project()
+    Uint64 version;
+
+    // clip space w of the vertices of the level being culled, see
+    // screenProjection()
+    float *clipW;
+    Uint8 *vertexColors;  // rgb per mesh vertex, tinted by each instance
+    int preparedInstances;  // instances the frames are sized for
+    bool instancesChanged;  // the frames show instances that are gone
+
+    Object3D() {
+        renderer = NULL;
+        file = NULL;
+        faces_row = 0;
+        radius = 0;
+        plot_points = NULL;
+        for (Frame &frame : frames) {
+            frame = {NULL, NULL, NULL, 0, 0, 0, 0, {}};
+        }
+        shown[0] = shown[1] = -1;
+        version = 0;
+        clipW = NULL;
+        vertexColors = NULL;
+        preparedInstances = 0;
+        instancesChanged = true;
+        model = Mat4::identity();
+    }
+
+    // owns its mesh and per frame buffers, so it can only be moved
+    Object3D(const Object3D &) = delete;
+    Object3D &operator=(const Object3D &) = delete;
+
+    Object3D(Object3D &&other) noexcept : Object3D() { swap(other); }
+
+    Object3D &operator=(Object3D &&other) noexcept {
+        swap(other);
+        return *this;
+    }
+
+    ~Object3D() { destroy(); }
+
+    void swap(Object3D &other) noexcept;
+    // colours every vertex at random, the same for the same seed
+    void prepare(unsigned colorSeed);
 
     static Object3D loadObj(const char *file, Renderer *r);
+    static Object3D loadObj(const char *file, Renderer *r, unsigned colorSeed);
 
-    void draw(bool dumpMatrices) {
-        screenProjection(dumpMatrices);
-        movement();
+    void addInstance(const Instance &instance) {
+        instances.push_back(instance);
+        instancesChanged = true;
+        version++;
     }
-    void screenProjection(bool dumpMatrices);
+    void clearInstances() {
+        instances.clear();
+        instancesChanged = true;
+        version++;
+    }
+    // The most instances whose frames SDL can still index, which counts
+    // vertices and indices in int
+    int maxInstances() const;
+
+    // Sizes the frames after the instances changed. Returns false when
+    // there was nothing to do, true when the frames were reset and have to
+    // be projected again before they can be drawn. Not while a frame of
+    // this object is projected.
+    bool prepareInstances();
+
+    // Readies what slot draws: reuses the frame the other slot shows when
+    // neither the object nor the view changed since it was projected,
+    // otherwise projects into the other frame and moves on the animation.
+    // Returns whether it projected. Safe on another thread than submit(), as
+    // long as the slots differ.
+    bool project(int slot, bool dumpMatrices);
+    // Hands the frame of slot to the rasterizer or SDL_RenderGeometry
+    void submit(int slot);
+    // Picks a level for every instance, transforms, gathers and culls them
+    // into frames[target]
+    void screenProjection(int target, bool dumpMatrices);
     void movement();
+    // the level an instance is drawn at this frame
+    int selectLevel(const Mat4 &instanceModel, const Mat4 &clipMatrix) const;
 
-    void translate(Point3D to) { vertices.multiply(Transform::translate(to)); }
+    // each of these only touches model, applied after what is already there
+    void translate(Point3D to) {
+        model = model * Transform::translate(to);
+        version++;
+    }
 
-    void scale(double by) { vertices.multiply(Transform::scale(by)); }
+    void scale(double by) {
+        model = model * Transform::scale(by);
+        version++;
+    }
 
     void rotate_x(double angle) {
-        vertices.multiply(Transform::rotate_x(angle));
+        model = model * Transform::rotate_x(angle);
+        version++;
     }
 
     void rotate_y(double angle) {
-        vertices.multiply(Transform::rotate_y(angle));
+        model = model * Transform::rotate_y(angle);
+        version++;
     }
 
     void rotate_z(double angle) {
-        vertices.multiply(Transform::rotate_z(angle));
+        model = model * Transform::rotate_z(angle);
+        version++;
     }
 
+    // Frees everything now instead of at destruction
     void destroy() {
         vertices.destroy();
         faces_row = 0;
-        projectionMatrix.destroy();
-        free(randomFaceColors);
+        faces.clear();
+        lods.clear();
         free(plot_points);
+        for (Frame &frame : frames) {
+            free(frame.sdl_vertices);
+            free(frame.sdl_depths);
+            free(frame.sdl_indices);
+            frame = {NULL, NULL, NULL, 0, 0, 0, 0, {}};
+        }
+        shown[0] = shown[1] = -1;
+        free(clipW);
+        free(vertexColors);
+        plot_points = NULL;
+        clipW = NULL;
+        vertexColors = NULL;
+        preparedInstances = 0;
     }
 };
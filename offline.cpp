@@ -0,0 +1,211 @@
+#include "offline.h"
+
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <atomic>
+#include <mutex>
+#include <string>
+
+#include "allocator.h"
+#include "renderer.h"
+#include "threadpool.h"
+
+// turntables scale the mesh to this radius and move it just far enough in
+// front of the camera to fit, with some room around it
+static const double FIT_RADIUS = 1, FIT_MARGIN = 1.1;
+// the vertex colours of every offline render, so that the frames of a
+// sequence agree whichever worker drew them
+static const unsigned COLOR_SEED = 1;
+
+// frames [first, last) of one file, the unit of work handed to a worker
+struct Job {
+    int file;
+    int first, last;
+};
+
+bool OfflineRenderer::loadPath(const char *file, std::vector<Pose> &poses) {
+    FILE *f = fopen(file, "r");
+    if (f == NULL) {
+        printf("[Error] Cannot open camera path: %s\n", file);
+        return false;
+    }
+    poses.clear();
+    char line[512];
+    int number = 0;
+    bool ok = true;
+    while (ok && fgets(line, sizeof(line), f)) {
+        number++;
+        const char *p = line;
+        while (*p == ' ' || *p == '\t') p++;
+        if (*p == '#' || *p == '\n' || *p == '\r' || *p == '\0') continue;
+        double x, y, z, yaw, pitch;
+        if (sscanf(p, "%lf %lf %lf %lf %lf", &x, &y, &z, &yaw, &pitch) != 5) {
+            printf("[Error] %s:%d: expected x y z yaw pitch\n", file, number);
+            ok = false;
+            break;
+        }
+        poses.push_back({Point3D(x, y, z), yaw * M_PI / 180, pitch * M_PI / 180});
+    }
+    fclose(f);
+    if (ok && poses.empty()) {
+        printf("[Error] No camera positions in: %s\n", file);
+        ok = false;
+    }
+    return ok;
+}
+
+// dir/<file without directory and extension>_<frame>.ppm
+static std::string imagePath(const char *dir, const char *file, int frame) {
+    const char *slash = strrchr(file, '/');
+    std::string name = slash ? slash + 1 : file;
+    const size_t dot = name.rfind('.');
+    if (dot != std::string::npos && dot > 0) name.resize(dot);
+    char suffix[32];
+    snprintf(suffix, sizeof(suffix), "_%04d.ppm", frame);
+    return std::string(dir) + "/" + name + suffix;
+}
+
+static bool writePPM(const char *path, const SDL_Surface *surface) {
+    FILE *f = fopen(path, "wb");
+    if (f == NULL) return false;
+    bool ok = fprintf(f, "P6\n%d %d\n255\n", surface->w, surface->h) > 0;
+    std::vector<Uint8> row(surface->w * 3);
+    for (int y = 0; ok && y < surface->h; y++) {
+        // ARGB8888, as Renderer creates its framebuffer
+        const Uint32 *pixels =
+            (const Uint32 *)((const Uint8 *)surface->pixels + y * surface->pitch);
+        for (int x = 0; x < surface->w; x++) {
+            row[x * 3] = pixels[x] >> 16;
+            row[x * 3 + 1] = pixels[x] >> 8;
+            row[x * 3 + 2] = pixels[x];
+        }
+        ok = fwrite(row.data(), row.size(), 1, f) == 1;
+    }
+    return fclose(f) == 0 && ok;
+}
+
+// Frame of a turntable of frames: the mesh turned around the y axis
+// through its centre, scaled to FIT_RADIUS and centred distance in front of
+// the camera
+static Instance turntable(const Object3D &mesh, int frame, int frames,
+                          double distance) {
+    const double yaw = 2 * M_PI * frame / frames;
+    const double scale = mesh.radius > 0 ? FIT_RADIUS / mesh.radius : 1;
+    const Vec4 center = Vec4(mesh.center.x * scale, mesh.center.y * scale,
+                             mesh.center.z * scale, 1) *
+                        Transform::rotate_y(yaw);
+    return Instance::place(
+        Point3D(-center.at(0), -center.at(1), distance - center.at(2)), yaw,
+        scale, {255, 255, 255, 255});
+}
+
+// Projects and rasterizes frame of the sequence into worker's framebuffer
+static void renderFrame(Renderer &worker, Object3D &mesh,
+                        const std::vector<OfflineRenderer::Pose> &path,
+                        int frame, int frames) {
+    if (path.empty()) {
+        const double halfFov =
+            atan(fmin(worker.projection.right, worker.projection.top));
+        const double distance = FIT_RADIUS * FIT_MARGIN / sin(halfFov);
+        mesh.clearInstances();
+        mesh.addInstance(turntable(mesh, frame, frames, distance));
+    } else {
+        const OfflineRenderer::Pose &pose = path[frame];
+        worker.camera.init(&worker, pose.position);
+        worker.camera.cameraPitch(pose.pitch);
+        worker.camera.cameraYaw(pose.yaw);
+    }
+    // no pipelining, the thread draws right after projecting
+    worker.scene.prepare();
+    worker.scene.project(0, false);
+    Allocator::endFrame();
+    worker.draw(0);
+    SDL_RenderPresent(worker.renderer);
+}
+
+int OfflineRenderer::run(const Renderer *settings) {
+    const std::vector<const char *> &files = settings->objFiles;
+    const char *dir = settings->renderDir;
+    if (files.empty()) {
+        printf("[Error] No obj files to render\n");
+        return 1;
+    }
+    std::vector<Pose> path;
+    if (settings->pathFile && !loadPath(settings->pathFile, path)) {
+        return files.size();
+    }
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+        printf("[Error] Cannot create directory: %s\n", dir);
+        return files.size();
+    }
+    const int frames = path.empty() ? settings->turntableFrames : path.size();
+
+    // With as many files as threads, every worker takes whole files and
+    // loads each of them once. With fewer, files are split into runs of
+    // frames so that no thread is left idle.
+    const int workers = ThreadPool::size();
+    const int runs = (workers + files.size() - 1) / files.size();
+    const int runLength = (frames + runs - 1) / runs;
+    std::vector<Job> jobs;
+    for (size_t f = 0; f < files.size(); f++) {
+        for (int first = 0; first < frames; first += runLength) {
+            jobs.push_back({(int)f, first, std::min(first + runLength, frames)});
+        }
+    }
+
+    std::atomic<int> nextJob(0), written(0);
+    std::mutex failedMutex;
+    std::vector<bool> failed(files.size(), false);
+    auto fail = [&](int file) {
+        std::lock_guard<std::mutex> lock(failedMutex);
+        failed[file] = true;
+    };
+
+    const Uint64 start = Profiler::now();
+    // the pool runs one worker per thread, and everything a worker does on
+    // the pool itself stays on its own thread
+    ThreadPool::parallel_for(workers, 1, [&](int begin, int end) {
+        for (int w = begin; w < end; w++) {
+            Renderer worker(settings);
+            int loaded = -1;
+            bool usable = false;
+            for (int j = nextJob++; j < (int)jobs.size(); j = nextJob++) {
+                const Job &job = jobs[j];
+                if (job.file != loaded) {
+                    loaded = job.file;
+                    worker.scene.destroy();
+                    Object3D &mesh = worker.scene.add(
+                        Object3D::loadObj(files[loaded], &worker, COLOR_SEED));
+                    // loadObj falls back to another file when this one fails
+                    usable = strcmp(mesh.file, files[loaded]) == 0;
+                    if (!usable) fail(loaded);
+                }
+                if (!usable) continue;
+                Object3D &mesh = worker.scene.meshes[0];
+                for (int frame = job.first; frame < job.last; frame++) {
+                    renderFrame(worker, mesh, path, frame, frames);
+                    const std::string image =
+                        imagePath(dir, files[loaded], frame);
+                    if (writePPM(image.c_str(), worker.framebuffer)) {
+                        written++;
+                    } else {
+                        printf("[Error] Cannot write %s\n", image.c_str());
+                        fail(loaded);
+                    }
+                }
+            }
+        }
+    });
+    const double seconds = (Profiler::now() - start) / 1e9;
+
+    int failures = 0;
+    for (bool f : failed) failures += f;
+    printf("%d images of %zu files in %.2fs, %.1f images/s on %d threads\n",
+           written.load(), files.size() - failures, seconds,
+           seconds > 0 ? written / seconds : 0, workers);
+    return failures;
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <vector>
+
+#include "matrix.h"
+
+struct Renderer;
+
+// Renders image sequences of obj files without a window, for batches of
+// preview renders. Every frame is independent of the others, so the frames
+// are spread over the ThreadPool threads, each drawing with an offscreen
+// Renderer of its own (scene, camera, culler, rasterizer and framebuffer).
+// Images are written as <dir>/<name>_<frame>.ppm.
+//
+//   ./renderer --render out --turntable 36 obj/cat.obj obj/deer.obj
+//   ./renderer --render out --path flight.txt obj/house.obj
+struct OfflineRenderer {
+    // A camera placement of a --path file, one per line as
+    // "x y z yaw pitch", with the angles in degrees. Lines starting with #
+    // are skipped.
+    struct Pose {
+        Point3D position;
+        double yaw, pitch;
+    };
+
+    static bool loadPath(const char *file, std::vector<Pose> &poses);
+
+    // Renders every obj file of settings, returns the number of files that
+    // could not be rendered, or 1 when there are none to render
+    static int run(const Renderer *settings);
+};
@@ -0,0 +1,162 @@
+#include <algorithm>
+#include <vector>
+
+#include "mesh.h"
+#include "profiler.h"
+
+// Vertex cache the faces are ordered for. Tipsify only needs a rough size,
+// and a few dozen vertices' worth of planes and SDL_Vertex entries stay in
+// the CPU caches as well.
+static const int CACHE_SIZE = 16;
+
+// Tipsify, from Sander, Nehab and Barczak, "Fast Triangle Reordering for
+// Vertex Locality and Reduced Overdraw". Fans around one vertex at a time
+// and picks the next fanning vertex among those just used, preferring ones
+// still in the cache that would not be evicted before their fan is done.
+static void tipsify(std::vector<int> &faces, int vertexCount) {
+    const int faceCount = faces.size() / 3;
+    // faces of every vertex, as one array indexed by offsets
+    std::vector<int> offsets(vertexCount + 1, 0), adjacency(faces.size());
+    for (int v : faces) offsets[v + 1]++;
+    for (int v = 0; v < vertexCount; v++) offsets[v + 1] += offsets[v];
+    std::vector<int> live(vertexCount);
+    for (int v = 0; v < vertexCount; v++) {
+        live[v] = offsets[v + 1] - offsets[v];
+    }
+    {
+        std::vector<int> fill(offsets.begin(), offsets.end() - 1);
+        for (int f = 0; f < faceCount; f++) {
+            for (int k = 0; k < 3; k++) adjacency[fill[faces[f * 3 + k]]++] = f;
+        }
+    }
+
+    std::vector<int> stamps(vertexCount, 0), deadEnds, candidates, out;
+    std::vector<char> emitted(faceCount, 0);
+    out.reserve(faces.size());
+    int time = CACHE_SIZE + 1, cursor = 0;
+    int fan = 0;
+    while (fan < vertexCount && live[fan] == 0) fan++;
+    while (fan >= 0 && fan < vertexCount) {
+        candidates.clear();
+        for (int i = offsets[fan]; i < offsets[fan + 1]; i++) {
+            const int f = adjacency[i];
+            if (emitted[f]) continue;
+            emitted[f] = 1;
+            for (int k = 0; k < 3; k++) {
+                const int v = faces[f * 3 + k];
+                out.push_back(v);
+                deadEnds.push_back(v);
+                candidates.push_back(v);
+                live[v]--;
+                if (time - stamps[v] > CACHE_SIZE) stamps[v] = time++;
+            }
+        }
+
+        int next = -1, best = -1;
+        for (int v : candidates) {
+            if (live[v] == 0) continue;
+            // how long v has been in the cache, unless its remaining faces
+            // would push it out before they are done
+            int priority = 0;
+            if (time - stamps[v] + 2 * live[v] <= CACHE_SIZE) {
+                priority = time - stamps[v];
+            }
+            if (priority > best) {
+                best = priority;
+                next = v;
+            }
+        }
+        if (next < 0) {
+            // a dead end: the most recent vertex with faces left, else the
+            // next one in input order
+            while (!deadEnds.empty() && next < 0) {
+                const int v = deadEnds.back();
+                deadEnds.pop_back();
+                if (live[v] > 0) next = v;
+            }
+            while (next < 0 && cursor < vertexCount) {
+                if (live[cursor] > 0) next = cursor;
+                cursor++;
+            }
+        }
+        fan = next;
+    }
+    faces.swap(out);
+}
+
+// Average number of vertices a FIFO cache of CACHE_SIZE misses per face
+double MeshData::acmr(const std::vector<int> &faces, int vertexCount) {
+    if (faces.empty()) return 0;
+    std::vector<int> stamps(vertexCount, -CACHE_SIZE - 1);
+    int time = 0, misses = 0;
+    for (int v : faces) {
+        if (time - stamps[v] > CACHE_SIZE) {
+            stamps[v] = time++;
+            misses++;
+        }
+    }
+    return (double)misses / (faces.size() / 3);
+}
+
+void MeshData::reorder(std::vector<double> &vertices, std::vector<int> &faces,
+                       std::vector<int> *source) {
+    const int vertexCount = vertices.size() / 4;
+    tipsify(faces, vertexCount);
+
+    // first use order, so the faces walk the vertices front to back
+    std::vector<int> remap(vertexCount, -1);
+    int used = 0;
+    for (int &v : faces) {
+        if (remap[v] < 0) remap[v] = used++;
+        v = remap[v];
+    }
+    std::vector<double> ordered((size_t)used * 4);
+    std::vector<int> orderedSource(source ? used : 0);
+    for (int v = 0; v < vertexCount; v++) {
+        if (remap[v] < 0) continue;
+        std::copy(&vertices[v * 4], &vertices[v * 4 + 4],
+                  &ordered[remap[v] * 4]);
+        if (source) orderedSource[remap[v]] = (*source)[v];
+    }
+    vertices.swap(ordered);
+    if (source) source->swap(orderedSource);
+}
+
+void MeshData::optimize() {
+    PROFILE_SCOPE("optimizeMesh");
+    useVectors();
+
+    // the same position under several indices, as obj files repeat them
+    // for every normal and texture coordinate, becomes one vertex
+    std::vector<int> order(vertexCount), weld(vertexCount);
+    for (int i = 0; i < vertexCount; i++) order[i] = i;
+    auto position = [&](int v) { return &vertices[v * 4]; };
+    std::sort(order.begin(), order.end(), [&](int a, int b) {
+        const double *pa = position(a), *pb = position(b);
+        for (int k = 0; k < 3; k++) {
+            if (pa[k] != pb[k]) return pa[k] < pb[k];
+        }
+        return a < b;
+    });
+    for (int i = 0; i < vertexCount; i++) {
+        const int v = order[i];
+        const bool same = i > 0 && std::equal(position(v), position(v) + 3,
+                                              position(order[i - 1]));
+        weld[v] = same ? weld[order[i - 1]] : v;
+    }
+
+    // faces that lost their area to welding draw nothing
+    size_t write = 0;
+    for (size_t f = 0; f < faces.size(); f += 3) {
+        const int a = weld[faces[f]], b = weld[faces[f + 1]],
+                  c = weld[faces[f + 2]];
+        if (a == b || b == c || a == c) continue;
+        faces[write++] = a;
+        faces[write++] = b;
+        faces[write++] = c;
+    }
+    faces.resize(write);
+
+    reorder(vertices, faces, NULL);
+    useVectors();
+}
@@ -0,0 +1,114 @@
+#include "pipeline.h"
+
+#include <errno.h>
+#include <time.h>
+
+#include "allocator.h"
+#include "profiler.h"
+#include "renderer.h"
+
+void FramePipeline::start(Renderer *r) {
+    renderer = r;
+    ready = pending = -1;
+    stopping = false;
+    thread = std::thread(&FramePipeline::loop, this);
+}
+
+void FramePipeline::stop() {
+    if (!thread.joinable()) return;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    thread.join();
+}
+
+void FramePipeline::project(int slot) {
+    renderer->scene.project(slot, inputs[slot].dumpMatrices);
+    // the frame matrices are on the device now, the arena can be reused
+    Allocator::endFrame();
+}
+
+int FramePipeline::begin(const Input &input) {
+    // reset slots hold nothing worth drawing
+    if (renderer->scene.prepare()) ready = -1;
+    if (ready < 0) {
+        PROFILE_SCOPE("prime");
+        ready = 0;
+        inputs[ready] = input;
+        project(ready);
+    }
+    const int slot = ready;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        pending = slot ^ 1;
+        inputs[pending] = input;
+    }
+    wake.notify_one();
+    return slot;
+}
+
+void FramePipeline::finish() {
+    std::unique_lock<std::mutex> lock(mutex);
+    done.wait(lock, [&] { return pending < 0; });
+}
+
+void FramePipeline::presented(int slot) {
+    static const int latency = Profiler::scopeId("input_to_present");
+    const Uint64 start = inputs[slot].time;
+    Profiler::record(latency, start, Profiler::now() - start);
+}
+
+void FramePipeline::loop() {
+    while (true) {
+        int slot;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            wake.wait(lock, [&] { return stopping || pending >= 0; });
+            if (stopping) return;
+            slot = pending;
+        }
+
+        project(slot);
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            ready = slot;
+            pending = -1;
+        }
+        done.notify_all();
+    }
+}
+
+void FramePacer::init(Mode m, int targetFps) {
+    mode = m;
+    fps = targetFps;
+    deadline = 0;
+}
+
+void FramePacer::wait() {
+    if (mode != PACE_TARGET || fps <= 0) return;
+    PROFILE_SCOPE("pace");
+    const Uint64 period = 1000000000ull / fps;
+    Uint64 now = Profiler::now();
+    // deadlines advance by whole periods so the rate does not drift, but a
+    // frame that ran long starts a new schedule instead of being caught up
+    deadline += period;
+    if (deadline + period < now) deadline = now;
+    if (now >= deadline) return;
+    // SDL_Delay only counts whole milliseconds, a high resolution timer on
+    // an absolute time wakes close to the deadline without spinning
+    const Uint64 remaining = deadline - now;
+    timespec until;
+    clock_gettime(CLOCK_MONOTONIC, &until);
+    until.tv_sec += remaining / 1000000000;
+    until.tv_nsec += remaining % 1000000000;
+    if (until.tv_nsec >= 1000000000) {
+        until.tv_sec++;
+        until.tv_nsec -= 1000000000;
+    }
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL) ==
+           EINTR) {
+    }
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <SDL2/SDL.h>
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+struct Renderer;
+
+// Projects frame N + 1 (transform, gather and culling of every mesh) on a
+// worker thread while the calling thread draws and presents frame N. Each
+// mesh keeps one Object3D::Frame per slot, the two slots take turns.
+//
+//   pipeline.finish();                    // the worker is idle from here
+//   ... read input, move the camera, change the scene ...
+//   int slot = pipeline.begin(input);     // until here
+//   ... submit frames[slot], present ...
+//   pipeline.presented(slot);
+//
+// Everything the projection reads (the scene, camera, projection and
+// culler) may only change between finish() and begin().
+struct FramePipeline {
+    static const int SLOTS = 2;
+
+    struct Input {
+        Uint64 time;  // Profiler::now() when the input was sampled
+        bool dumpMatrices;
+    };
+
+    FramePipeline()
+        : renderer(NULL), ready(-1), pending(-1), stopping(false) {}
+    ~FramePipeline() { stop(); }
+
+    void start(Renderer *r);
+    void stop();
+
+    // Hands the worker the next frame and returns the slot of the one to
+    // draw now. Without a finished frame to draw, as at the start or after
+    // the scene changed, it is projected on the calling thread first.
+    int begin(const Input &input);
+    // Waits for the frame handed over by the last begin()
+    void finish();
+    // Records the input to present latency of the frame in slot. Call right
+    // after presenting it.
+    void presented(int slot);
+
+   private:
+    Renderer *renderer;
+    // the last finished slot, and the one the worker is projecting
+    int ready, pending;
+    Input inputs[SLOTS];
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable wake, done;
+    bool stopping;
+
+    void project(int slot);
+    void loop();
+};
+
+// Spaces frames evenly. With a target rate it sleeps on a high resolution
+// timer until the frame is due, instead of spinning on a core.
+struct FramePacer {
+    enum Mode { PACE_TARGET, PACE_VSYNC, PACE_UNCAPPED };
+
+    Mode mode;
+    int fps;
+
+    FramePacer() : mode(PACE_UNCAPPED), fps(0), deadline(0) {}
+    void init(Mode m, int targetFps);
+
+    // Waits until the next frame is due. Returns at once with vsync, where
+    // presenting waits instead, or uncapped.
+    void wait();
+
+   private:
+    Uint64 deadline;
+};
@@ -0,0 +1,234 @@
+#include "profiler.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+
+#include "kernel.h"
+
+const char *Profiler::counterNames[Profiler::COUNTER_COUNT] = {
+    "triangles", "vertices", "bytes_to_device", "bytes_from_device"};
+
+std::atomic<bool> Profiler::enabled(true);
+std::atomic<Uint64> Profiler::counters[Profiler::COUNTER_COUNT];
+
+// Multi-producer ring that overwrites its oldest entries. Every slot carries
+// a sequence number which is odd while the slot is written, so readers can
+// skip slots that are torn or were recycled while being copied.
+template <typename T, int N>
+struct Ring {
+    static_assert((N & (N - 1)) == 0, "ring size must be a power of two");
+
+    struct Slot {
+        std::atomic<Uint64> seq;
+        T value;
+    };
+
+    std::atomic<Uint64> head;
+    Slot slots[N];
+
+    void push(const T &value) {
+        Uint64 i = head.fetch_add(1, std::memory_order_relaxed);
+        Slot &slot = slots[i & (N - 1)];
+        slot.seq.store(2 * i + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        slot.value = value;
+        slot.seq.store(2 * i + 2, std::memory_order_release);
+    }
+
+    void collect(std::vector<T> &out) {
+        Uint64 end = head.load(std::memory_order_acquire);
+        Uint64 begin = end > N ? end - N : 0;
+        out.clear();
+        out.reserve(end - begin);
+        for (Uint64 i = begin; i < end; i++) {
+            Slot &slot = slots[i & (N - 1)];
+            Uint64 seq = slot.seq.load(std::memory_order_acquire);
+            if (seq != 2 * i + 2) continue;
+            T value = slot.value;
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (slot.seq.load(std::memory_order_relaxed) != seq) continue;
+            out.push_back(value);
+        }
+    }
+
+    void clear() {
+        // only called while nothing records
+        for (Slot &slot : slots) slot.seq.store(0, std::memory_order_relaxed);
+        head.store(0, std::memory_order_release);
+    }
+};
+
+static const int MAX_SCOPES = 64;
+
+static Ring<Profiler::Sample, 1 << 16> samples;
+static Ring<Profiler::FrameSample, 1 << 12> frames;
+
+static std::mutex scopeMutex;
+static const char *scopeNames[MAX_SCOPES];
+static std::atomic<int> scopes(0);
+
+static std::atomic<Uint64> frameNumber(0);
+static Uint64 frameStart = 0;
+static Uint64 lastCounters[Profiler::COUNTER_COUNT];
+static std::atomic<bool> deviceSync(false);
+
+static thread_local int depth = 0;
+
+Uint64 Profiler::now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+int Profiler::scopeId(const char *name) {
+    std::lock_guard<std::mutex> lock(scopeMutex);
+    int count = scopes.load();
+    for (int i = 0; i < count; i++) {
+        if (strcmp(scopeNames[i], name) == 0) return i;
+    }
+    if (count == MAX_SCOPES) {
+        printf("[Profiler] too many scopes, %s is merged into %s\n", name,
+               scopeNames[count - 1]);
+        return count - 1;
+    }
+    scopeNames[count] = name;
+    scopes.store(count + 1);
+    return count;
+}
+
+const char *Profiler::scopeName(int id) { return scopeNames[id]; }
+
+int Profiler::scopeCount() { return scopes.load(); }
+
+Profiler::Scope::Scope(int i) {
+    id = i;
+    running = enabled.load(std::memory_order_relaxed);
+    if (!running) return;
+    depth = ::depth++;
+    start = now();
+}
+
+void Profiler::Scope::stop() {
+    if (!running) return;
+    running = false;
+    ::depth--;
+    if (deviceSync.load(std::memory_order_relaxed)) GPU::synchronize();
+    Uint64 end = now();
+    samples.push({frameNumber.load(std::memory_order_relaxed), start,
+                  end - start, id, depth});
+}
+
+void Profiler::record(int scope, Uint64 start, Uint64 ns) {
+    if (!enabled.load(std::memory_order_relaxed)) return;
+    samples.push({frameNumber.load(std::memory_order_relaxed), start, ns,
+                  scope, 0});
+}
+
+void Profiler::endFrame() {
+    Uint64 end = now();
+    FrameSample frame;
+    frame.frame = frameNumber.fetch_add(1, std::memory_order_relaxed);
+    frame.start = frameStart ? frameStart : end;
+    frame.ns = end - frame.start;
+    for (int i = 0; i < COUNTER_COUNT; i++) {
+        Uint64 total = counters[i].load(std::memory_order_relaxed);
+        frame.counters[i] = total - lastCounters[i];
+        lastCounters[i] = total;
+    }
+    frameStart = end;
+    if (enabled.load(std::memory_order_relaxed)) frames.push(frame);
+}
+
+void Profiler::setDeviceSync(bool sync) { deviceSync.store(sync); }
+
+void Profiler::collect(std::vector<Sample> &out) { samples.collect(out); }
+
+void Profiler::collectFrames(std::vector<FrameSample> &out) {
+    frames.collect(out);
+}
+
+void Profiler::reset() {
+    samples.clear();
+    frames.clear();
+    frameStart = now();
+    for (int i = 0; i < COUNTER_COUNT; i++) {
+        lastCounters[i] = counters[i].load();
+    }
+}
+
+static void dumpJSON(FILE *f, const std::vector<Profiler::Sample> &s,
+                     const std::vector<Profiler::FrameSample> &fr) {
+    fprintf(f, "{\n  \"scopes\": [");
+    for (int i = 0; i < Profiler::scopeCount(); i++) {
+        fprintf(f, "%s\"%s\"", i ? ", " : "", Profiler::scopeName(i));
+    }
+    fprintf(f, "],\n  \"samples\": [");
+    for (size_t i = 0; i < s.size(); i++) {
+        fprintf(f,
+                "%s\n    {\"frame\": %lu, \"scope\": \"%s\", \"depth\": %d, "
+                "\"start_ns\": %lu, \"ns\": %lu}",
+                i ? "," : "", (unsigned long)s[i].frame,
+                Profiler::scopeName(s[i].scope), s[i].depth,
+                (unsigned long)s[i].start, (unsigned long)s[i].ns);
+    }
+    fprintf(f, "\n  ],\n  \"frames\": [");
+    for (size_t i = 0; i < fr.size(); i++) {
+        fprintf(f, "%s\n    {\"frame\": %lu, \"start_ns\": %lu, \"ns\": %lu",
+                i ? "," : "", (unsigned long)fr[i].frame,
+                (unsigned long)fr[i].start, (unsigned long)fr[i].ns);
+        for (int c = 0; c < Profiler::COUNTER_COUNT; c++) {
+            fprintf(f, ", \"%s\": %lu", Profiler::counterNames[c],
+                    (unsigned long)fr[i].counters[c]);
+        }
+        fprintf(f, "}");
+    }
+    fprintf(f, "\n  ],\n  \"totals\": {");
+    for (int c = 0; c < Profiler::COUNTER_COUNT; c++) {
+        fprintf(f, "%s\"%s\": %lu", c ? ", " : "", Profiler::counterNames[c],
+                (unsigned long)Profiler::counters[c].load());
+    }
+    fprintf(f, "}\n}\n");
+}
+
+static void dumpCSV(FILE *f, const std::vector<Profiler::Sample> &s,
+                    const std::vector<Profiler::FrameSample> &fr) {
+    // scopes and per-frame counters share one table, told apart by kind
+    fprintf(f, "kind,frame,name,depth,start_ns,value\n");
+    for (const Profiler::Sample &sample : s) {
+        fprintf(f, "scope,%lu,%s,%d,%lu,%lu\n", (unsigned long)sample.frame,
+                Profiler::scopeName(sample.scope), sample.depth,
+                (unsigned long)sample.start, (unsigned long)sample.ns);
+    }
+    for (const Profiler::FrameSample &frame : fr) {
+        fprintf(f, "frame,%lu,frame_ns,0,%lu,%lu\n", (unsigned long)frame.frame,
+                (unsigned long)frame.start, (unsigned long)frame.ns);
+        for (int c = 0; c < Profiler::COUNTER_COUNT; c++) {
+            fprintf(f, "counter,%lu,%s,0,%lu,%lu\n", (unsigned long)frame.frame,
+                    Profiler::counterNames[c], (unsigned long)frame.start,
+                    (unsigned long)frame.counters[c]);
+        }
+    }
+}
+
+bool Profiler::dump(const char *path) {
+    FILE *f = fopen(path, "w");
+    if (f == NULL) {
+        printf("[Error] Cannot write profile to: %s\n", path);
+        return false;
+    }
+    std::vector<Sample> s;
+    std::vector<FrameSample> fr;
+    collect(s);
+    collectFrames(fr);
+
+    size_t len = strlen(path);
+    if (len >= 5 && strcmp(path + len - 5, ".json") == 0) {
+        dumpJSON(f, s, fr);
+    } else {
+        dumpCSV(f, s, fr);
+    }
+    fclose(f);
+    return true;
+}
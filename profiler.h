@@ -0,0 +1,90 @@
+#pragma once
+
+#include <SDL2/SDL_timer.h>
+
+#include <atomic>
+#include <vector>
+
+// Always-on instrumentation for the hot path. Scopes are timed with a
+// nanosecond clock and pushed into lock-free ring buffers, so recording costs
+// two clock reads and a few stores. Nothing is printed while running; dump()
+// writes the retained history on demand.
+//
+//   PROFILE_SCOPE("gather");            // times the rest of the block
+//   PROFILE_START(present);             // or an explicit start/end pair
+//   SDL_RenderPresent(renderer);
+//   PROFILE_END(present);
+struct Profiler {
+    enum Counter { TRIANGLES, VERTICES, BYTES_TO_DEVICE, BYTES_FROM_DEVICE };
+    static const int COUNTER_COUNT = BYTES_FROM_DEVICE + 1;
+    static const char *counterNames[COUNTER_COUNT];
+
+    // one finished scope; depth is its nesting level on the recording thread
+    struct Sample {
+        Uint64 frame, start, ns;
+        int scope, depth;
+    };
+
+    // one frame, from the previous endFrame() to this one
+    struct FrameSample {
+        Uint64 frame, start, ns;
+        Uint64 counters[COUNTER_COUNT];
+    };
+
+    struct Scope {
+        int id, depth;
+        Uint64 start;
+        bool running;
+
+        explicit Scope(int id);
+        ~Scope() { stop(); }
+        void stop();
+    };
+
+    static std::atomic<bool> enabled;
+    static std::atomic<Uint64> counters[COUNTER_COUNT];
+
+    static Uint64 now();
+
+    // Registers a scope name once per call site, see PROFILE_SCOPE
+    static int scopeId(const char *name);
+    static const char *scopeName(int id);
+    static int scopeCount();
+
+    static void count(Counter c, Uint64 n) {
+        counters[c].fetch_add(n, std::memory_order_relaxed);
+    }
+
+    // Records a span timed by hand, for intervals that do not fit in one
+    // scope, like the latency from sampling input to presenting it
+    static void record(int scope, Uint64 start, Uint64 ns);
+
+    // Closes the current frame and snapshots the counters into it
+    static void endFrame();
+    // Make scopes wait for queued device work before they stop the clock.
+    // Gives exact per-stage numbers at the cost of serializing the GPU.
+    static void setDeviceSync(bool sync);
+
+    // Copies out the retained history, oldest first
+    static void collect(std::vector<Sample> &samples);
+    static void collectFrames(std::vector<FrameSample> &frames);
+    static void reset();
+
+    // Writes JSON when path ends in .json, CSV otherwise
+    static bool dump(const char *path);
+};
+
+#define PROFILE_CONCAT_(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_(a, b)
+
+#define PROFILE_SCOPE(name)                                               \
+    static const int PROFILE_CONCAT(__profile_id_, __LINE__) =            \
+        Profiler::scopeId(name);                                          \
+    Profiler::Scope PROFILE_CONCAT(__profile_scope_, __LINE__)(           \
+        PROFILE_CONCAT(__profile_id_, __LINE__))
+
+#define PROFILE_START(x)                                                  \
+    static const int __profile_id_##x = Profiler::scopeId(#x);            \
+    Profiler::Scope __profile_scope_##x(__profile_id_##x)
+
+#define PROFILE_END(x) __profile_scope_##x.stop()
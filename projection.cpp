@@ -19,4 +19,5 @@ void Projection::init(Renderer *renderer) {
 
     double hw = renderer->H_WIDTH, hh = renderer->H_HEIGHT;
     to_screen_matrix.fill(hw, 0, 0, 0, 0, -hh, 0, 0, 0, 0, 1, 0, hw, hh, 0, 1);
+    version++;
 }
@@ -6,9 +6,11 @@ struct Renderer;
 
 struct Projection {
     double near, far, left, right, top, bottom;
-    ConstantMatrix<4, 4> projection_matrix;
-    ConstantMatrix<4, 4> to_screen_matrix;
+    Mat4 projection_matrix;
+    Mat4 to_screen_matrix;
+    // bumped by every init()
+    Uint64 version;
 
-    Projection() {}
+    Projection() : version(0) {}
     void init(Renderer *renderer);
 };
@@ -0,0 +1,227 @@
+#include "rasterizer.h"
+
+#include <float.h>
+#include <math.h>
+
+#include "profiler.h"
+#include "threadpool.h"
+
+void Rasterizer::init(SDL_Renderer *renderer, int w, int h) {
+    width = w;
+    height = h;
+    tilesX = (w + TILE_SIZE - 1) / TILE_SIZE;
+    tilesY = (h + TILE_SIZE - 1) / TILE_SIZE;
+    texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888,
+                                SDL_TEXTUREACCESS_STREAMING, w, h);
+    depth = (float *)malloc(sizeof(float) * w * h);
+    // one set of bins per thread that can take part in binning
+    ThreadPool::init();
+    bins.resize(ThreadPool::size() * tilesX * tilesY);
+}
+
+void Rasterizer::destroy() {
+    if (texture) SDL_DestroyTexture(texture);
+    free(depth);
+    texture = NULL;
+    depth = NULL;
+}
+
+void Rasterizer::beginFrame() {
+    PROFILE_SCOPE("rasterClear");
+    void *locked;
+    SDL_LockTexture(texture, NULL, &locked, &pitch);
+    pixels = (Uint32 *)locked;
+    pitch /= sizeof(Uint32);
+    ThreadPool::parallel_for(height, 64, [&](int begin, int end) {
+        for (int y = begin; y < end; y++) {
+            Uint32 *row = &pixels[y * pitch];
+            float *depthRow = &depth[y * width];
+            for (int x = 0; x < width; x++) {
+                row[x] = 0xff000000;
+                depthRow[x] = FLT_MAX;
+            }
+        }
+    });
+}
+
+void Rasterizer::endFrame(SDL_Renderer *renderer) {
+    SDL_UnlockTexture(texture);
+    pixels = NULL;
+    SDL_RenderCopy(renderer, texture, NULL, NULL);
+}
+
+void Rasterizer::repeatFrame(SDL_Renderer *renderer) {
+    SDL_RenderCopy(renderer, texture, NULL, NULL);
+}
+
+// Builds the edge functions and attribute planes of one triangle. Returns
+// false for triangles that cover no area or lie completely off screen.
+static bool setupTriangle(Rasterizer::Triangle &t, const SDL_Vertex *vertices,
+                          const float *depths, const int *index, int width,
+                          int height) {
+    const SDL_Vertex v[3] = {vertices[index[0]], vertices[index[1]],
+                             vertices[index[2]]};
+    const float d[3] = {depths[index[0]], depths[index[1]], depths[index[2]]};
+    int i0 = 0, i1 = 1, i2 = 2;
+    float area = (v[1].position.x - v[0].position.x) *
+                     (v[2].position.y - v[0].position.y) -
+                 (v[2].position.x - v[0].position.x) *
+                     (v[1].position.y - v[0].position.y);
+    if (area == 0 || isnan(area)) return false;
+    if (area < 0) {
+        // either winding is drawn, flip to keep the edge functions positive
+        i1 = 2;
+        i2 = 1;
+        area = -area;
+    }
+    const int idx[3] = {i0, i1, i2};
+    float x[3], y[3];
+    for (int k = 0; k < 3; k++) {
+        x[k] = v[idx[k]].position.x;
+        y[k] = v[idx[k]].position.y;
+    }
+
+    t.minX = fminf(x[0], fminf(x[1], x[2]));
+    t.maxX = fmaxf(x[0], fmaxf(x[1], x[2]));
+    t.minY = fminf(y[0], fminf(y[1], y[2]));
+    t.maxY = fmaxf(y[0], fmaxf(y[1], y[2]));
+    if (t.maxX < 0 || t.maxY < 0 || t.minX >= width || t.minY >= height) {
+        return false;
+    }
+
+    // edge k runs between the two vertices other than k
+    for (int k = 0; k < 3; k++) {
+        int p = (k + 1) % 3, q = (k + 2) % 3;
+        t.a[k] = -(y[q] - y[p]);
+        t.b[k] = x[q] - x[p];
+        t.c[k] = -(t.a[k] * x[p] + t.b[k] * y[p]);
+        // pixels exactly on an edge shared by two triangles belong to one
+        t.topLeft[k] = t.a[k] > 0 || (t.a[k] == 0 && t.b[k] > 0);
+    }
+
+    float inv = 1 / area;
+    float attr[4][3];
+    for (int k = 0; k < 3; k++) {
+        const SDL_Vertex &vk = v[idx[k]];
+        attr[0][k] = d[idx[k]];
+        attr[1][k] = vk.color.r;
+        attr[2][k] = vk.color.g;
+        attr[3][k] = vk.color.b;
+    }
+    float *planes[4] = {t.z, t.r, t.g, t.bl};
+    for (int p = 0; p < 4; p++) {
+        float dx = 0, dy = 0, v0 = 0;
+        for (int k = 0; k < 3; k++) {
+            dx += t.a[k] * attr[p][k];
+            dy += t.b[k] * attr[p][k];
+            v0 += t.c[k] * attr[p][k];
+        }
+        planes[p][0] = dx * inv;
+        planes[p][1] = dy * inv;
+        planes[p][2] = v0 * inv;
+    }
+    return true;
+}
+
+static inline Uint32 toChannel(float c) {
+    return c <= 0 ? 0 : c >= 255 ? 255 : (Uint32)c;
+}
+
+void Rasterizer::rasterizeTile(int tile, int chunks) {
+    const int tileCount = tilesX * tilesY;
+    const int tx0 = (tile % tilesX) * TILE_SIZE;
+    const int ty0 = (tile / tilesX) * TILE_SIZE;
+    const int tx1 = tx0 + TILE_SIZE < width ? tx0 + TILE_SIZE : width;
+    const int ty1 = ty0 + TILE_SIZE < height ? ty0 + TILE_SIZE : height;
+
+    // chunks are visited in order, so equal depths keep submission order
+    for (int chunk = 0; chunk < chunks; chunk++) {
+        for (int id : bins[chunk * tileCount + tile]) {
+            const Triangle &t = triangles[id];
+            // clamped before the casts, faces crossing the near plane reach
+            // far beyond what an int holds
+            const float minX = fmaxf(t.minX, tx0), maxX = fminf(t.maxX, tx1);
+            const float minY = fmaxf(t.minY, ty0), maxY = fminf(t.maxY, ty1);
+            const int x0 = (int)ceilf(minX - 0.5f),
+                      x1 = (int)floorf(maxX - 0.5f);
+            const int y0 = (int)ceilf(minY - 0.5f),
+                      y1 = (int)floorf(maxY - 0.5f);
+
+            const float a0 = t.a[0], a1 = t.a[1], a2 = t.a[2], dz = t.z[0];
+            const bool tl0 = t.topLeft[0], tl1 = t.topLeft[1],
+                       tl2 = t.topLeft[2];
+            for (int y = y0; y <= y1; y++) {
+                float px = x0 + 0.5f, py = y + 0.5f;
+                float e0 = a0 * px + t.b[0] * py + t.c[0];
+                float e1 = a1 * px + t.b[1] * py + t.c[1];
+                float e2 = a2 * px + t.b[2] * py + t.c[2];
+                float z = dz * px + t.z[1] * py + t.z[2];
+                Uint32 *row = &pixels[y * pitch];
+                float *depthRow = &depth[y * width];
+                for (int x = x0; x <= x1; x++) {
+                    bool inside = ((e0 > 0) | (tl0 & (e0 == 0))) &
+                                  ((e1 > 0) | (tl1 & (e1 == 0))) &
+                                  ((e2 > 0) | (tl2 & (e2 == 0)));
+                    if (inside && z < depthRow[x]) {
+                        depthRow[x] = z;
+                        float cx = x + 0.5f;
+                        Uint32 r = toChannel(t.r[0] * cx + t.r[1] * py + t.r[2]);
+                        Uint32 g = toChannel(t.g[0] * cx + t.g[1] * py + t.g[2]);
+                        Uint32 b =
+                            toChannel(t.bl[0] * cx + t.bl[1] * py + t.bl[2]);
+                        row[x] = 0xff000000 | (r << 16) | (g << 8) | b;
+                    }
+                    e0 += a0;
+                    e1 += a1;
+                    e2 += a2;
+                    z += dz;
+                }
+            }
+        }
+    }
+}
+
+void Rasterizer::draw(const SDL_Vertex *vertices, const float *depths,
+                      const int *indices, int count) {
+    const int triangleCount = count / 3;
+    if (triangleCount == 0) return;
+    const int tileCount = tilesX * tilesY;
+    const int chunks = bins.size() / tileCount;
+    triangles.resize(triangleCount);
+
+    PROFILE_START(rasterBin);
+    // every chunk sets up and bins its own slice of the triangles
+    ThreadPool::parallel_for(chunks, 1, [&](int begin, int end) {
+        for (int chunk = begin; chunk < end; chunk++) {
+            for (int tile = 0; tile < tileCount; tile++) {
+                bins[chunk * tileCount + tile].clear();
+            }
+            int first = (long)triangleCount * chunk / chunks;
+            int last = (long)triangleCount * (chunk + 1) / chunks;
+            for (int i = first; i < last; i++) {
+                Triangle &t = triangles[i];
+                if (!setupTriangle(t, vertices, depths, &indices[i * 3], width,
+                                   height)) {
+                    continue;
+                }
+                int bx0 = t.minX < 0 ? 0 : (int)t.minX / TILE_SIZE;
+                int by0 = t.minY < 0 ? 0 : (int)t.minY / TILE_SIZE;
+                int bx1 = t.maxX >= width ? tilesX - 1 : (int)t.maxX / TILE_SIZE;
+                int by1 =
+                    t.maxY >= height ? tilesY - 1 : (int)t.maxY / TILE_SIZE;
+                for (int by = by0; by <= by1; by++) {
+                    for (int bx = bx0; bx <= bx1; bx++) {
+                        bins[chunk * tileCount + by * tilesX + bx].push_back(i);
+                    }
+                }
+            }
+        }
+    });
+    PROFILE_END(rasterBin);
+
+    PROFILE_START(rasterFill);
+    ThreadPool::parallel_for(tileCount, 1, [&](int begin, int end) {
+        for (int tile = begin; tile < end; tile++) rasterizeTile(tile, chunks);
+    });
+    PROFILE_END(rasterFill);
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <SDL2/SDL.h>
+
+#include <vector>
+
+// Depth tested software rasterizer. Triangles are binned into screen tiles
+// and the tiles are filled in parallel on the ThreadPool, straight into a
+// streaming texture that is then copied to the renderer.
+//
+//   rasterizer.beginFrame();
+//   rasterizer.draw(vertices, depths, indices, count);  // any number of times
+//   rasterizer.endFrame(renderer);
+struct Rasterizer {
+    static const int TILE_SIZE = 64;
+
+    // per triangle setup shared by every tile it touches
+    struct Triangle {
+        float minX, minY, maxX, maxY;
+        // edge functions e(x, y) = a * x + b * y + c, inside when all >= 0
+        float a[3], b[3], c[3];
+        bool topLeft[3];
+        // depth and colour as planes over the screen: v = dx * x + dy * y + v0
+        float z[3], r[3], g[3], bl[3];
+    };
+
+    int width, height, tilesX, tilesY;
+    SDL_Texture *texture;
+    Uint32 *pixels;  // locked texture memory between beginFrame and endFrame
+    int pitch;       // in pixels
+    float *depth;
+    std::vector<Triangle> triangles;
+    // bins[chunk * tileCount + tile] lists the triangles binned by one chunk
+    std::vector<std::vector<int>> bins;
+
+    Rasterizer() : texture(NULL), pixels(NULL), depth(NULL) {}
+
+    void init(SDL_Renderer *renderer, int w, int h);
+    void destroy();
+
+    // Locks the texture and clears colour and depth
+    void beginFrame();
+    // Rasterizes count / 3 triangles, three indices into vertices each.
+    // depths holds a depth per vertex, where smaller is closer.
+    void draw(const SDL_Vertex *vertices, const float *depths,
+              const int *indices, int count);
+    // Unlocks the texture and copies it to the renderer
+    void endFrame(SDL_Renderer *renderer);
+    // Copies the last frame to the renderer again, instead of drawing it
+    void repeatFrame(SDL_Renderer *renderer);
+
+   private:
+    void rasterizeTile(int tile, int chunks);
+};
@@ -7,38 +7,186 @@
 // for font functions
 #include <SDL2/SDL_ttf.h>
 
+#include <algorithm>
+#include <vector>
+
+#include "allocator.h"
 #include "renderer.h"
+#include "threadpool.h"
 
 const char* objectList[] = {
     "obj/apartment.obj", "obj/basketball.obj", "obj/cat.obj", "obj/deer.obj",
     "obj/house.obj",     "obj/tank.obj",       "obj/wolf.obj"};
+const int objectListSize = sizeof(objectList) / sizeof(objectList[0]);
 
 Renderer::Renderer(int argc, char** argv) {
+    headlessFrames = 0;
+    objFile = NULL;
+    instanceCount = 1;
+    profilePath = NULL;
+    renderDir = NULL;
+    turntableFrames = 36;
+    pathFile = NULL;
+    parent = NULL;
+    useLod = true;
+    animate = true;
+    settingsVersion = 0;
+    rasterizedFrame = 0;
+    pacer.init(FramePacer::PACE_TARGET, FPS);
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--headless") == 0 && i + 1 < argc) {
+            headlessFrames = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc) {
+            profilePath = argv[++i];
+        } else if (strcmp(argv[i], "--instances") == 0 && i + 1 < argc) {
+            instanceCount = atoi(argv[++i]);
+            if (instanceCount < 1) instanceCount = 1;
+        } else if (strcmp(argv[i], "--fps") == 0 && i + 1 < argc) {
+            int fps = atoi(argv[++i]);
+            pacer.init(fps > 0 ? FramePacer::PACE_TARGET
+                               : FramePacer::PACE_UNCAPPED,
+                       fps);
+        } else if (strcmp(argv[i], "--no-lod") == 0) {
+            useLod = false;
+        } else if (strcmp(argv[i], "--still") == 0) {
+            animate = false;
+        } else if (strcmp(argv[i], "--vsync") == 0) {
+            pacer.init(FramePacer::PACE_VSYNC, 0);
+        } else if (strcmp(argv[i], "--render") == 0 && i + 1 < argc) {
+            renderDir = argv[++i];
+        } else if (strcmp(argv[i], "--turntable") == 0 && i + 1 < argc) {
+            turntableFrames = atoi(argv[++i]);
+            if (turntableFrames < 1) turntableFrames = 1;
+        } else if (strcmp(argv[i], "--path") == 0 && i + 1 < argc) {
+            pathFile = argv[++i];
+        } else {
+            objFile = argv[i];
+            objFiles.push_back(objFile);
+        }
+    }
+
+    window = NULL;
+    renderer = NULL;
+    framebuffer = NULL;
+    GPU::init();
+    // the workers bring their own renderers
+    if (renderDir) return;
+    if (headlessFrames > 0) {
+        initOffscreen();
+        pipeline.start(this);
+        return;
+    }
+
     // returns zero on success else non-zero
     if (SDL_Init(SDL_INIT_VIDEO) != 0) {
         printf("error initializing SDL: %s\n", SDL_GetError());
     }
-    GPU::init();
     window = SDL_CreateWindow("GAME", SDL_WINDOWPOS_CENTERED,
                               SDL_WINDOWPOS_CENTERED, WIDTH, HEIGHT, 0);
-    renderer = SDL_CreateRenderer(window, -1, RENDER_FLAGS);
+    Uint32 flags = RENDER_FLAGS;
+    if (pacer.mode == FramePacer::PACE_VSYNC) {
+        flags |= SDL_RENDERER_PRESENTVSYNC;
+    }
+    renderer = SDL_CreateRenderer(window, -1, flags);
+    useRasterizer = true;
+    rasterizer.init(renderer, WIDTH, HEIGHT);
 
     TTF_Init();
 
     camera.init(this, {0, 0, 0});
     projection.init(this);
-    object = Object3D::loadObj(argc > 1 ? argv[1] : NULL, this);
-    // object.translate({0.2, 0.4, 0.2});
-    // object.rotate_y(M_PI / 6);
+    culler.init(WIDTH, HEIGHT, projection.near, projection.far);
+    show(Object3D::loadObj(objFile, this));
+    pipeline.start(this);
+
+    // N shows objectList[0] first, have it ready by then
+    loader.start(this);
+    loader.request(objectList[0]);
+}
+
+Renderer::Renderer(const Renderer *p) {
+    headlessFrames = 0;
+    objFile = NULL;
+    instanceCount = 1;
+    profilePath = NULL;
+    renderDir = NULL;
+    turntableFrames = 0;
+    pathFile = NULL;
+    parent = p;
+    useLod = p->useLod;
+    animate = false;
+    settingsVersion = 0;
+    rasterizedFrame = 0;
+    window = NULL;
+    initOffscreen();
+    culler.mode = p->culler.mode;
+}
+
+void Renderer::initOffscreen() {
+    // the software renderer draws into a surface, no video device needed
+    framebuffer = SDL_CreateRGBSurfaceWithFormat(0, WIDTH, HEIGHT, 32,
+                                                 SDL_PIXELFORMAT_ARGB8888);
+    renderer = SDL_CreateSoftwareRenderer(framebuffer);
+    useRasterizer = true;
+    rasterizer.init(renderer, WIDTH, HEIGHT);
+    camera.init(this, {0, 0, 0});
+    projection.init(this);
+    culler.init(WIDTH, HEIGHT, projection.near, projection.far);
 }
 
 Renderer::~Renderer() {
-    SDL_DestroyRenderer(renderer);
-    SDL_DestroyWindow(window);
+    if (parent) {
+        // the pool, the backend and SDL are still in use by the others
+        scene.destroy();
+        rasterizer.destroy();
+        SDL_DestroyRenderer(renderer);
+        SDL_FreeSurface(framebuffer);
+        return;
+    }
+    if (profilePath) Profiler::dump(profilePath);
+    pipeline.stop();
+    scene.destroy();
+    Allocator::trim();
+    rasterizer.destroy();
+    // the pool threads wait on statics that are torn down after main
+    ThreadPool::shutdown();
+    if (renderer) SDL_DestroyRenderer(renderer);
+    if (window) SDL_DestroyWindow(window);
+    if (framebuffer) SDL_FreeSurface(framebuffer);
     SDL_Quit();
 }
 
-void Renderer::draw(bool dumpMatrices) { object.draw(dumpMatrices); }
+bool Renderer::show(Object3D &&object) {
+    scene.destroy();
+    // what the previous scene held is unlikely to fit the next one
+    Allocator::trim();
+    Object3D &mesh = scene.add(std::move(object));
+    if (instanceCount > mesh.maxInstances()) {
+        printf("[Error] %s allows at most %d instances, not %d\n", mesh.file,
+               mesh.maxInstances(), instanceCount);
+        return false;
+    }
+    if (instanceCount > 1) Scene::scatter(mesh, instanceCount);
+    return true;
+}
+
+void Renderer::draw(int slot) {
+    SDL_RenderClear(renderer);
+    if (!useRasterizer) {
+        scene.submit(slot);
+        return;
+    }
+    const Uint64 frame = scene.frameId(slot);
+    if (frame != 0 && frame == rasterizedFrame) {
+        // nothing moved, the texture still holds this frame
+        rasterizer.repeatFrame(renderer);
+        return;
+    }
+    rasterizer.beginFrame();
+    scene.submit(slot);
+    rasterizer.endFrame(renderer);
+    rasterizedFrame = frame;
+}
 
 struct TextInfo {
     SDL_Texture* textTexture;
@@ -70,10 +218,18 @@ void Renderer::run() {
     Uint64 lastTick = SDL_GetTicks64();
     Uint64 lastText = 0;
     int objectCount = 0;
+    // the object N asked for, drawn as soon as the loader has it
+    const char* pendingObject = NULL;
     char fpsStr[50] = {'.', '.', '.'};
     TTF_Font* FONT = TTF_OpenFont("font.ttf", 20);
     TextInfo fpsInfo = {NULL, {0, 0, 0, 0}};
     while (!close) {
+        // the worker is done with the scene until begin() below
+        pipeline.finish();
+        // sleep before sampling input, not after, so that pacing does not
+        // add to the latency
+        pacer.wait();
+        FramePipeline::Input input = {Profiler::now(), dumpVertices};
         SDL_Event event;
         while (SDL_PollEvent(&event)) {
             switch (event.type) {
@@ -86,6 +242,29 @@ void Renderer::run() {
                     if (event.key.keysym.sym == SDLK_x) {
                         dumpVertices = true;
                     }
+                    if (event.key.keysym.sym == SDLK_r) {
+                        useRasterizer = !useRasterizer;
+                    }
+                    if (event.key.keysym.sym == SDLK_l) {
+                        useLod = !useLod;
+                        settingsVersion++;
+                        printf("Level of detail: %s\n", useLod ? "on" : "off");
+                    }
+                    if (event.key.keysym.sym == SDLK_m) {
+                        animate = !animate;
+                        printf("Rotation: %s\n", animate ? "on" : "off");
+                    }
+                    if (event.key.keysym.sym == SDLK_b) {
+                        static const char* modes[] = {"off", "back", "front"};
+                        culler.mode = (Culler::Mode)((culler.mode + 1) % 3);
+                        settingsVersion++;
+                        printf("Face culling: %s\n", modes[culler.mode]);
+                    }
+                    if (event.key.keysym.sym == SDLK_p) {
+                        Profiler::dump("profile.csv");
+                        Profiler::dump("profile.json");
+                        printf("Profile written to profile.csv/json\n");
+                    }
                     break;
                 };
                 case SDL_KEYUP: {
@@ -96,17 +275,27 @@ void Renderer::run() {
             }
         }
         if (keys[SDLK_n]) {
-            object.destroy();
+            if (!pendingObject) {
+                pendingObject = objectList[objectCount];
+                loader.request(pendingObject);
+                objectCount = (objectCount + 1) % objectListSize;
+            }
+            keys[SDLK_n] = false;
+        }
+        Object3D next;
+        if (pendingObject && loader.take(pendingObject, next)) {
             camera.init(this, {0, 0, 0});
             projection.init(this);
-            object = Object3D::loadObj(objectList[objectCount], this);
-            objectCount = (objectCount + 1) % 7;
-            keys[SDLK_n] = false;
+            show(std::move(next));
+            pendingObject = NULL;
+            // speculatively load what the next N will ask for
+            loader.request(objectList[objectCount]);
         }
         camera.control(keys);
+        // projects the next frame in the background while this one is drawn
+        int slot = pipeline.begin(input);
         // SDL_SetRenderDrawColor(renderer, 0, 0, 0, 0);
-        SDL_RenderClear(renderer);
-        draw(dumpVertices);
+        draw(slot);
         Uint64 currentTick = SDL_GetTicks64();
         if (currentTick - lastText > 1000) {
             Uint64 ms = currentTick - lastTick;
@@ -118,9 +307,100 @@ void Renderer::run() {
             fpsInfo = drawText(renderer, FONT, fpsStr, fpsInfo);
         }
         SDL_RenderCopy(renderer, fpsInfo.textTexture, NULL, &fpsInfo.destRect);
-        MEASURE(SDL_RenderPresent(renderer));
+        PROFILE_START(present);
+        SDL_RenderPresent(renderer);
+        PROFILE_END(present);
+        pipeline.presented(slot);
         lastTick = currentTick;
+        Profiler::endFrame();
+    }
+}
+
+static void printTimings(const char* name, int depth,
+                         std::vector<Uint64>& samples) {
+    if (samples.empty()) return;
+    std::sort(samples.begin(), samples.end());
+    size_t n = samples.size();
+    printf("  %*s%-*s %10.3f %10.3f %10.3f\n", depth * 2, "", 20 - depth * 2,
+           name, samples[0] / 1e6, samples[n / 2] / 1e6,
+           samples[(n - 1) * 99 / 100] / 1e6);
+}
+
+int Renderer::runHeadless() {
+    const char* const* files = objFile ? &objFile : objectList;
+    int fileCount = objFile ? 1 : objectListSize;
+    int failures = 0;
+
+    // exact stage numbers need the device to finish inside each scope
+    Profiler::setDeviceSync(true);
+    for (int f = 0; f < fileCount; f++) {
+        camera.init(this, {0, 0, 0});
+        projection.init(this);
+        if (!show(Object3D::loadObj(files[f], this))) {
+            failures++;
+            scene.destroy();
+            continue;
+        }
+
+        Profiler::reset();
+        for (int i = 0; i < headlessFrames; i++) {
+            pipeline.finish();
+            int slot = pipeline.begin({Profiler::now(), false});
+            draw(slot);
+            SDL_RenderPresent(renderer);
+            pipeline.presented(slot);
+            Profiler::endFrame();
+        }
+        // the scene is about to change, the frame after the last is unused
+        pipeline.finish();
+
+        std::vector<Profiler::Sample> samples;
+        std::vector<Profiler::FrameSample> frames;
+        Profiler::collect(samples);
+        Profiler::collectFrames(frames);
+
+        // scopes in the order they first started, nested ones indented
+        std::vector<int> order, depth(Profiler::scopeCount(), -1);
+        std::vector<Uint64> firstStart(Profiler::scopeCount());
+        std::vector<std::vector<Uint64>> times(Profiler::scopeCount());
+        for (const Profiler::Sample& s : samples) {
+            if (depth[s.scope] == -1) {
+                order.push_back(s.scope);
+                depth[s.scope] = s.depth;
+                firstStart[s.scope] = s.start;
+            }
+            times[s.scope].push_back(s.ns);
+        }
+        std::sort(order.begin(), order.end(), [&](int a, int b) {
+            return firstStart[a] < firstStart[b];
+        });
+        std::vector<Uint64> frameTimes;
+        Uint64 totals[Profiler::COUNTER_COUNT] = {0};
+        for (const Profiler::FrameSample& fs : frames) {
+            frameTimes.push_back(fs.ns);
+            for (int c = 0; c < Profiler::COUNTER_COUNT; c++) {
+                totals[c] += fs.counters[c];
+            }
+        }
+
+        printf("%s: %d instances, %ld vertices, %ld triangles, %d frames\n",
+               files[f], scene.instanceCount(), scene.vertexCount(),
+               scene.faceCount(), headlessFrames);
+        printf("  %-20s %10s %10s %10s\n", "stage", "min(ms)", "median(ms)",
+               "p99(ms)");
+        for (int id : order) {
+            printTimings(Profiler::scopeName(id), depth[id], times[id]);
+        }
+        printTimings("frame", 0, frameTimes);
+        for (int c = 0; c < Profiler::COUNTER_COUNT; c++) {
+            printf("  %-20s %10lu per frame\n", Profiler::counterNames[c],
+                   (unsigned long)(frames.empty() ? 0
+                                                  : totals[c] / frames.size()));
+        }
+        Allocator::printStats();
 
-        // SDL_Delay(1000 / FPS);
+        scene.destroy();
     }
+    Profiler::setDeviceSync(false);
+    return failures;
 }
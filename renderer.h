@@ -2,9 +2,20 @@
 
 #include <SDL2/SDL.h>
 
+#include <vector>
+
 #include "camera.h"
-#include "object3d.h"
+#include "culler.h"
+#include "loader.h"
+#include "pipeline.h"
 #include "projection.h"
+#include "rasterizer.h"
+#include "scene.h"
+
+// the models in obj/, what N cycles through and --headless measures without
+// an obj file
+extern const char *objectList[];
+extern const int objectListSize;
 
 template <typename A, typename B>
 struct Tuple {
@@ -16,21 +27,83 @@ struct Renderer {
     const int WIDTH = 1920, HEIGHT = 1080;
     const Tuple<int, int> RES = {WIDTH, HEIGHT};
     const int H_HEIGHT = HEIGHT / 2, H_WIDTH = WIDTH / 2;
-    const int FPS = 144;
+    const int FPS = 144;  // target rate unless --fps or --vsync say otherwise
 
     const Uint32 RENDER_FLAGS = SDL_RENDERER_ACCELERATED;
 
     SDL_Window *window;
     SDL_Renderer *renderer;
+    // offscreen target of the software renderer in headless mode
+    SDL_Surface *framebuffer;
+    // frames to render per object with --headless, 0 opens a window
+    int headlessFrames;
+    const char *objFile;
+    // every obj file on the command line, objFile is the last one
+    std::vector<const char *> objFiles;
+    // --instances: copies of each loaded object placed in the scene
+    int instanceCount;
+    // --profile: where the profiler history is written on exit
+    const char *profilePath;
+    // --render <dir>: write image sequences of objFiles there, see
+    // OfflineRenderer. Each is a --turntable of n frames, or follows the
+    // camera --path in a file.
+    const char *renderDir;
+    int turntableFrames;
+    const char *pathFile;
+    // the renderer whose settings an offline worker took, NULL otherwise
+    const Renderer *parent;
+
+    // depth tested tiled rasterizer, R switches back to SDL_RenderGeometry
+    Rasterizer rasterizer;
+    bool useRasterizer;
+    // clipping and face culling in front of either, B cycles the culling
+    Culler culler;
+    // draw distant instances from simplified meshes, L or --no-lod turn it
+    // off
+    bool useLod;
+    // turns every mesh a little each frame, M or --still stop it
+    bool animate;
+    // bumped when a setting that changes what is projected does, like
+    // culling or useLod
+    Uint64 settingsVersion;
+    // Scene::frameId() of what the rasterizer texture holds
+    Uint64 rasterizedFrame;
 
-    Object3D object;
+    Scene scene;
+    // loads the next entry of objectList while the current one is drawn
+    MeshLoader loader;
     Camera camera;
     Projection projection;
+    // projects the next frame while the current one is drawn and presented
+    FramePipeline pipeline;
+    // --fps <n> (0 for uncapped) or --vsync, only for the window
+    FramePacer pacer;
 
     Renderer(int argc, char **argv);
+    // An offscreen renderer with the settings of parent, for a worker of an
+    // OfflineRenderer. It draws into a framebuffer of its own and leaves the
+    // compute backend and SDL to parent.
+    explicit Renderer(const Renderer *parent);
     ~Renderer();
 
+    // Changes whenever the camera, the projection or settingsVersion do.
+    // With it and Object3D::version unchanged, a mesh projects the same.
+    Uint64 viewVersion() const {
+        return camera.version + projection.version + settingsVersion;
+    }
+
     void createObjects();
-    void draw(bool dumpMatrices);
+    // Makes the scene the given object, scattered per --instances. Returns
+    // false, leaving a single instance, when there are more than it allows.
+    bool show(Object3D &&object);
+    // Draws the frame the pipeline left in slot, without presenting it
+    void draw(int slot);
     void run();
+    // returns the number of files that could not be measured
+    int runHeadless();
+
+   private:
+    // a software renderer drawing into framebuffer, with the camera,
+    // projection and culler set up for it
+    void initOffscreen();
 };
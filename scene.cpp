@@ -0,0 +1,72 @@
+#include "scene.h"
+
+#include <math.h>
+
+Object3D &Scene::add(Object3D &&mesh) {
+    meshes.push_back(std::move(mesh));
+    return meshes.back();
+}
+
+void Scene::scatter(Object3D &mesh, int count) {
+    mesh.clearInstances();
+    const int cols = ceil(sqrt((double)count));
+    // far enough apart that neighbours never overlap, whatever their yaw
+    const double spacing = 2.5 * (mesh.radius > 0 ? mesh.radius : 1);
+    const Point3D &c = mesh.center;
+    for (int k = 0; k < count; k++) {
+        const double yaw = 2 * M_PI * rand() / RAND_MAX;
+        const double dx = (k % cols - (cols - 1) / 2.0) * spacing;
+        const double dz = (k / cols) * spacing;
+        // turn around the mesh centre rather than the origin
+        const double cy = cos(yaw), sy = sin(yaw);
+        Point3D position(c.x + dx - (c.x * cy + c.z * sy), 0,
+                         c.z + dz - (c.z * cy - c.x * sy));
+        SDL_Color color = {(Uint8)(128 + rand() % 128),
+                           (Uint8)(128 + rand() % 128),
+                           (Uint8)(128 + rand() % 128), 255};
+        mesh.addInstance(Instance::place(position, yaw, 1, color));
+    }
+}
+
+bool Scene::prepare() {
+    bool reset = false;
+    for (Object3D &mesh : meshes) reset |= mesh.prepareInstances();
+    return reset;
+}
+
+void Scene::project(int slot, bool dumpMatrices) {
+    bool projected = false;
+    for (Object3D &mesh : meshes) projected |= mesh.project(slot, dumpMatrices);
+    frameIds[slot] = projected ? ++lastFrameId : frameIds[slot ^ 1];
+}
+
+void Scene::submit(int slot) {
+    for (Object3D &mesh : meshes) mesh.submit(slot);
+}
+
+int Scene::instanceCount() const {
+    int count = 0;
+    for (const Object3D &mesh : meshes) count += mesh.instances.size();
+    return count;
+}
+
+long Scene::vertexCount() const {
+    long count = 0;
+    for (const Object3D &mesh : meshes) {
+        count += (long)mesh.vertices.count * mesh.instances.size();
+    }
+    return count;
+}
+
+long Scene::faceCount() const {
+    long count = 0;
+    for (const Object3D &mesh : meshes) {
+        count += (long)mesh.faces_row * mesh.instances.size();
+    }
+    return count;
+}
+
+void Scene::destroy() {
+    meshes.clear();
+    frameIds[0] = frameIds[1] = 0;
+}
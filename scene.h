@@ -0,0 +1,40 @@
+#pragma once
+
+#include <vector>
+
+#include "object3d.h"
+
+// Everything drawn in a frame. Each mesh is loaded once and owns the
+// instances placed with it, so a scene of many copies costs one transform
+// and one culling pass per mesh, not per copy.
+struct Scene {
+    std::vector<Object3D> meshes;
+
+    // Takes over a loaded object, which keeps its instances. The reference
+    // is only good until the next add().
+    Object3D &add(Object3D &&mesh);
+
+    // Replaces the instances of mesh with count copies on a grid in front of
+    // where it was loaded, each turned and tinted at random
+    static void scatter(Object3D &mesh, int count);
+
+    // Readies every mesh for projection, see Object3D::prepareInstances().
+    // Returns whether any frame slot was reset.
+    bool prepare();
+    // project() and submit() of every mesh
+    void project(int slot, bool dumpMatrices);
+    void submit(int slot);
+    // Identifies what slot shows. Slots showing the same frames of every
+    // mesh have the same id, 0 matches nothing.
+    Uint64 frameId(int slot) const { return frameIds[slot]; }
+
+    int instanceCount() const;
+    long vertexCount() const;  // over all instances
+    long faceCount() const;    // over all instances
+
+    void destroy();
+
+   private:
+    Uint64 frameIds[Object3D::FRAME_SLOTS] = {0, 0};
+    Uint64 lastFrameId = 0;
+};
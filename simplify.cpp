@@ -0,0 +1,506 @@
+#include <math.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <queue>
+#include <vector>
+
+#include "mesh.h"
+#include "profiler.h"
+
+// Quadric error edge collapse after Garland and Heckbert, "Surface
+// Simplification Using Quadric Error Metrics". Every vertex carries the sum
+// of the squared distance functions of the planes around it, and the edge
+// whose collapse adds the least error goes first.
+
+// symmetric 4x4, upper triangle row by row
+struct Quadric {
+    double a[10];
+
+    Quadric() {
+        for (double &x : a) x = 0;
+    }
+
+    // adds the squared distance to the plane n . p + d = 0
+    void addPlane(const double n[3], double d, double weight) {
+        const double p[4] = {n[0], n[1], n[2], d};
+        int k = 0;
+        for (int i = 0; i < 4; i++) {
+            for (int j = i; j < 4; j++) a[k++] += weight * p[i] * p[j];
+        }
+    }
+
+    Quadric operator+(const Quadric &o) const {
+        Quadric q;
+        for (int i = 0; i < 10; i++) q.a[i] = a[i] + o.a[i];
+        return q;
+    }
+
+    double error(const double p[3]) const {
+        const double x = p[0], y = p[1], z = p[2];
+        return a[0] * x * x + 2 * a[1] * x * y + 2 * a[2] * x * z +
+               2 * a[3] * x + a[4] * y * y + 2 * a[5] * y * z + 2 * a[6] * y +
+               a[7] * z * z + 2 * a[8] * z + a[9];
+    }
+
+    // the point of least error, false when there is no single one
+    bool minimum(double p[3]) const {
+        const double m00 = a[0], m01 = a[1], m02 = a[2], m11 = a[4],
+                     m12 = a[5], m22 = a[7];
+        const double c0 = m11 * m22 - m12 * m12, c1 = m02 * m12 - m01 * m22,
+                     c2 = m01 * m12 - m02 * m11;
+        const double det = m00 * c0 + m01 * c1 + m02 * c2;
+        const double scale = m00 * m00 + m11 * m11 + m22 * m22;
+        if (fabs(det) <= 1e-12 * scale * sqrt(scale)) return false;
+        const double b0 = -a[3], b1 = -a[6], b2 = -a[8];
+        p[0] = (c0 * b0 + c1 * b1 + c2 * b2) / det;
+        p[1] = (c1 * b0 + (m00 * m22 - m02 * m02) * b1 +
+                (m01 * m02 - m00 * m12) * b2) /
+               det;
+        p[2] = (c2 * b0 + (m01 * m02 - m00 * m12) * b1 +
+                (m00 * m11 - m01 * m01) * b2) /
+               det;
+        return true;
+    }
+};
+
+// kept small, the heap holds millions of them for large meshes
+struct Collapse {
+    double cost;
+    int u, v;                     // v goes, u moves, see Simplifier::place
+    unsigned versionU, versionV;  // stale once either vertex changed
+
+    bool operator<(const Collapse &o) const { return cost > o.cost; }
+};
+
+// borders would shrink away without these, they are kept in place by a
+// plane through each border edge, at right angles to its face
+static const double BORDER_WEIGHT = 10;
+
+static void cross(const double a[3], const double b[3], double out[3]) {
+    out[0] = a[1] * b[2] - a[2] * b[1];
+    out[1] = a[2] * b[0] - a[0] * b[2];
+    out[2] = a[0] * b[1] - a[1] * b[0];
+}
+
+struct Simplifier {
+    std::vector<double> pos;  // x, y, z
+    std::vector<Quadric> quadrics;
+    std::vector<unsigned> versions;
+    std::vector<char> vertexAlive;
+    std::vector<int> faces;
+    std::vector<char> faceAlive;
+    std::vector<std::vector<int>> vertexFaces;
+    std::priority_queue<Collapse> heap;
+    int faceCount;
+    double maxError;
+
+    const double *at(int v) const { return &pos[v * 3]; }
+
+    void normal(int f, int moved, const double *to, double n[3]) const {
+        const double *p[3];
+        for (int k = 0; k < 3; k++) {
+            const int v = faces[f * 3 + k];
+            p[k] = v == moved ? to : at(v);
+        }
+        const double e1[3] = {p[1][0] - p[0][0], p[1][1] - p[0][1],
+                              p[1][2] - p[0][2]};
+        const double e2[3] = {p[2][0] - p[0][0], p[2][1] - p[0][1],
+                              p[2][2] - p[0][2]};
+        cross(e1, e2, n);
+    }
+
+    bool hasVertex(int f, int v) const {
+        return faces[f * 3] == v || faces[f * 3 + 1] == v ||
+               faces[f * 3 + 2] == v;
+    }
+
+    void init(const MeshData &mesh) {
+        const int n = mesh.vertexCount;
+        pos.resize(n * 3);
+        for (int i = 0; i < n; i++) {
+            for (int k = 0; k < 3; k++) {
+                pos[i * 3 + k] = mesh.vertexData[i * 4 + k];
+            }
+        }
+        quadrics.assign(n, Quadric());
+        versions.assign(n, 0);
+        vertexAlive.assign(n, 1);
+        vertexFaces.assign(n, std::vector<int>());
+        faces.assign(mesh.faceData, mesh.faceData + mesh.faceCount * 3);
+        faceAlive.assign(mesh.faceCount, 1);
+        faceCount = mesh.faceCount;
+        maxError = 0;
+
+        // vertices in the same place, like the seams of uv mapped models,
+        // become one, or the seams would split the surface into pieces
+        std::vector<int> order(n), weld(n);
+        for (int i = 0; i < n; i++) order[i] = i;
+        std::sort(order.begin(), order.end(), [&](int a, int b) {
+            for (int k = 0; k < 3; k++) {
+                if (at(a)[k] != at(b)[k]) return at(a)[k] < at(b)[k];
+            }
+            return a < b;
+        });
+        for (int i = 0; i < n; i++) {
+            const int v = order[i], prev = i ? order[i - 1] : -1;
+            const bool same = prev >= 0 && at(v)[0] == at(prev)[0] &&
+                              at(v)[1] == at(prev)[1] &&
+                              at(v)[2] == at(prev)[2];
+            weld[v] = same ? weld[prev] : v;
+            if (same) vertexAlive[v] = 0;
+        }
+
+        // every edge of every face as low << 32 | high, the ones only seen
+        // once are on a border
+        std::vector<long long> edges;
+        edges.reserve(faces.size());
+        for (int f = 0; f < mesh.faceCount; f++) {
+            int *t = &faces[f * 3];
+            bool valid = true;
+            for (int k = 0; k < 3; k++) {
+                valid = valid && t[k] >= 0 && t[k] < n;
+                if (valid) t[k] = weld[t[k]];
+            }
+            if (!valid || t[0] == t[1] || t[1] == t[2] || t[0] == t[2]) {
+                faceAlive[f] = 0;
+                faceCount--;
+                continue;
+            }
+            double nrm[3];
+            normal(f, -1, NULL, nrm);
+            const double len = sqrt(nrm[0] * nrm[0] + nrm[1] * nrm[1] +
+                                    nrm[2] * nrm[2]);
+            for (int k = 0; k < 3; k++) vertexFaces[t[k]].push_back(f);
+            if (len == 0) continue;
+            for (double &x : nrm) x /= len;
+            const double d = -(nrm[0] * at(t[0])[0] + nrm[1] * at(t[0])[1] +
+                               nrm[2] * at(t[0])[2]);
+            for (int k = 0; k < 3; k++) quadrics[t[k]].addPlane(nrm, d, 1);
+            for (int k = 0; k < 3; k++) {
+                const int a = t[k], b = t[(k + 1) % 3];
+                edges.push_back((long long)std::min(a, b) << 32 |
+                                std::max(a, b));
+            }
+        }
+
+        std::sort(edges.begin(), edges.end());
+        for (size_t i = 0; i < edges.size(); i++) {
+            const bool first = i == 0 || edges[i - 1] != edges[i];
+            const bool last = i + 1 == edges.size() || edges[i + 1] != edges[i];
+            if (first && last) addBorder(edges[i] >> 32, edges[i] & 0xffffffff);
+        }
+        // only now that every quadric is complete
+        edges.erase(std::unique(edges.begin(), edges.end()), edges.end());
+        for (long long e : edges) push(e >> 32, e & 0xffffffff);
+    }
+
+    void addBorder(int a, int b) {
+        for (int f : vertexFaces[a]) {
+            if (!faceAlive[f] || !hasVertex(f, b)) continue;
+            double fn[3], e[3], n[3];
+            normal(f, -1, NULL, fn);
+            for (int k = 0; k < 3; k++) e[k] = at(b)[k] - at(a)[k];
+            cross(e, fn, n);
+            const double len = sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+            if (len == 0) return;
+            for (double &x : n) x /= len;
+            const double d =
+                -(n[0] * at(a)[0] + n[1] * at(a)[1] + n[2] * at(a)[2]);
+            quadrics[a].addPlane(n, d, BORDER_WEIGHT);
+            quadrics[b].addPlane(n, d, BORDER_WEIGHT);
+            return;
+        }
+    }
+
+    // where collapsing v into u puts u, returns the error it adds
+    double place(int u, int v, double target[3]) const {
+        const Quadric q = quadrics[u] + quadrics[v];
+        if (!q.minimum(target)) {
+            // flat or along a line: the best of the ends and the middle
+            const double mid[3] = {(at(u)[0] + at(v)[0]) / 2,
+                                   (at(u)[1] + at(v)[1]) / 2,
+                                   (at(u)[2] + at(v)[2]) / 2};
+            const double *candidates[3] = {at(u), at(v), mid};
+            for (int k = 0; k < 3; k++) target[k] = at(u)[k];
+            double best = HUGE_VAL;
+            for (const double *p : candidates) {
+                const double e = q.error(p);
+                if (e < best) {
+                    best = e;
+                    for (int k = 0; k < 3; k++) target[k] = p[k];
+                }
+            }
+        }
+        return std::max(0.0, q.error(target));
+    }
+
+    void push(int u, int v) {
+        double target[3];
+        heap.push({place(u, v, target), u, v, versions[u], versions[v]});
+    }
+
+    void neighbours(int v, std::vector<int> &out) const {
+        out.clear();
+        for (int f : vertexFaces[v]) {
+            if (!faceAlive[f]) continue;
+            for (int k = 0; k < 3; k++) {
+                const int w = faces[f * 3 + k];
+                if (w != v) out.push_back(w);
+            }
+        }
+        std::sort(out.begin(), out.end());
+        out.erase(std::unique(out.begin(), out.end()), out.end());
+    }
+
+    // Whether collapsing v into u keeps the surface a manifold and turns no
+    // face over
+    bool allowed(const Collapse &c, const double target[3],
+                 std::vector<int> &nu, std::vector<int> &nv) const {
+        // the only vertices next to both may be the tips of the faces that
+        // share the edge, anything more pinches the surface
+        neighbours(c.u, nu);
+        neighbours(c.v, nv);
+        int common = 0, shared = 0;
+        for (size_t i = 0, j = 0; i < nu.size() && j < nv.size();) {
+            if (nu[i] < nv[j]) {
+                i++;
+            } else if (nu[i] > nv[j]) {
+                j++;
+            } else {
+                common++;
+                i++;
+                j++;
+            }
+        }
+        for (int f : vertexFaces[c.u]) {
+            if (faceAlive[f] && hasVertex(f, c.v)) shared++;
+        }
+        if (shared == 0 || common > shared) return false;
+
+        const int ends[2] = {c.u, c.v};
+        for (int moved : ends) {
+            for (int f : vertexFaces[moved]) {
+                if (!faceAlive[f] || hasVertex(f, ends[moved == c.u])) {
+                    continue;
+                }
+                double before[3], after[3];
+                normal(f, -1, NULL, before);
+                normal(f, moved, target, after);
+                const double dot = before[0] * after[0] +
+                                   before[1] * after[1] +
+                                   before[2] * after[2];
+                if (dot <= 0) return false;
+            }
+        }
+        return true;
+    }
+
+    void collapse(const Collapse &c, const double target[3]) {
+        const int u = c.u, v = c.v;
+        for (int k = 0; k < 3; k++) pos[u * 3 + k] = target[k];
+        quadrics[u] = quadrics[u] + quadrics[v];
+        vertexAlive[v] = 0;
+        for (int f : vertexFaces[v]) {
+            if (!faceAlive[f]) continue;
+            if (hasVertex(f, u)) {
+                faceAlive[f] = 0;
+                faceCount--;
+                continue;
+            }
+            for (int k = 0; k < 3; k++) {
+                if (faces[f * 3 + k] == v) faces[f * 3 + k] = u;
+            }
+            vertexFaces[u].push_back(f);
+        }
+        std::vector<int>().swap(vertexFaces[v]);
+        std::vector<int> &own = vertexFaces[u];
+        own.erase(std::remove_if(own.begin(), own.end(),
+                                 [&](int f) { return !faceAlive[f]; }),
+                  own.end());
+        versions[u]++;
+        maxError = std::max(maxError, sqrt(c.cost));
+    }
+
+    // collapses until no more than target faces are left, or nothing can go
+    void run(int target) {
+        std::vector<int> nu, nv;
+        while (faceCount > target && !heap.empty()) {
+            const Collapse c = heap.top();
+            heap.pop();
+            if (!vertexAlive[c.u] || !vertexAlive[c.v] ||
+                versions[c.u] != c.versionU || versions[c.v] != c.versionV) {
+                continue;
+            }
+            double target[3];
+            place(c.u, c.v, target);
+            if (!allowed(c, target, nu, nv)) continue;
+            collapse(c, target);
+            neighbours(c.u, nu);
+            for (int w : nu) push(c.u, w);
+        }
+    }
+
+    void snapshot(MeshLevel &level) const {
+        std::vector<int> remap(vertexAlive.size(), -1);
+        level.vertices.clear();
+        level.faces.clear();
+        level.source.clear();
+        for (size_t f = 0; f < faceAlive.size(); f++) {
+            if (!faceAlive[f]) continue;
+            for (int k = 0; k < 3; k++) {
+                const int v = faces[f * 3 + k];
+                if (remap[v] < 0) {
+                    remap[v] = level.source.size();
+                    level.source.push_back(v);
+                    level.vertices.insert(level.vertices.end(),
+                                          {at(v)[0], at(v)[1], at(v)[2], 1});
+                }
+                level.faces.push_back(remap[v]);
+            }
+        }
+        level.error = maxError;
+    }
+};
+
+void MeshData::simplify(std::vector<MeshLevel> &levels, int minFaces) const {
+    PROFILE_SCOPE("simplify");
+    levels.clear();
+    if (faceCount / 2 < minFaces) return;
+    Simplifier s;
+    s.init(*this);
+    int target = faceCount / 2;
+    while (target >= minFaces) {
+        const int before = s.faceCount;
+        s.run(target);
+        // stuck, most collapses left would break the surface
+        if (s.faceCount > before / 4 * 3) break;
+        levels.emplace_back();
+        MeshLevel &level = levels.back();
+        s.snapshot(level);
+        reorder(level.vertices, level.faces, &level.source);
+        if (s.heap.empty()) break;
+        target = s.faceCount / 2;
+    }
+}
+
+// Layout of a .rlod cache file: this header, then for every level its
+// LevelHeader, vertexCount * 4 doubles, faceCount * 3 ints and vertexCount
+// source ints. Stale like the .rmesh cache once the source file changes.
+struct LevelCacheHeader {
+    char magic[4];
+    unsigned int version;
+    long long sourceSize, sourceMtime;
+    int minFaces, levelCount;
+};
+
+struct LevelHeader {
+    int vertexCount, faceCount;
+    double error;
+};
+
+static const char LEVEL_MAGIC[4] = {'R', 'L', 'O', 'D'};
+static const unsigned int LEVEL_VERSION = 2;
+
+// Reads what writeLevels() wrote for a base mesh of baseVertices vertices.
+// Fails on a level indexing past its own vertices, or with sources past
+// the base mesh's, as loadObj() looks both up without checking.
+static bool readLevels(FILE *f, const LevelCacheHeader &expected,
+                       int baseVertices, std::vector<MeshLevel> &levels) {
+    LevelCacheHeader header;
+    if (fread(&header, sizeof(header), 1, f) != 1 ||
+        memcmp(header.magic, LEVEL_MAGIC, 4) != 0 ||
+        header.version != LEVEL_VERSION ||
+        header.sourceSize != expected.sourceSize ||
+        header.sourceMtime != expected.sourceMtime ||
+        header.minFaces != expected.minFaces || header.levelCount < 0) {
+        return false;
+    }
+    levels.resize(header.levelCount);
+    for (MeshLevel &level : levels) {
+        LevelHeader lh;
+        if (fread(&lh, sizeof(lh), 1, f) != 1 || lh.vertexCount < 0 ||
+            lh.faceCount < 0) {
+            return false;
+        }
+        level.vertices.resize((size_t)lh.vertexCount * 4);
+        level.faces.resize((size_t)lh.faceCount * 3);
+        level.source.resize(lh.vertexCount);
+        level.error = lh.error;
+        if (fread(level.vertices.data(), sizeof(double),
+                  level.vertices.size(), f) != level.vertices.size() ||
+            fread(level.faces.data(), sizeof(int), level.faces.size(), f) !=
+                level.faces.size() ||
+            fread(level.source.data(), sizeof(int), level.source.size(), f) !=
+                level.source.size()) {
+            return false;
+        }
+        for (int index : level.faces) {
+            if (index < 0 || index >= lh.vertexCount) return false;
+        }
+        for (int index : level.source) {
+            if (index < 0 || index >= baseVertices) return false;
+        }
+    }
+    // nothing may follow, or the file is not what the header says
+    return fgetc(f) == EOF;
+}
+
+static bool writeLevels(const char *cacheFile, LevelCacheHeader header,
+                        const std::vector<MeshLevel> &levels) {
+    char tmpFile[4096 + 32];
+    MeshData::tempName(tmpFile, sizeof(tmpFile), cacheFile);
+    FILE *f = fopen(tmpFile, "wb");
+    if (f == NULL) return false;
+    header.levelCount = levels.size();
+    bool ok = fwrite(&header, sizeof(header), 1, f) == 1;
+    for (const MeshLevel &level : levels) {
+        const LevelHeader lh = {(int)level.source.size(),
+                                (int)level.faces.size() / 3, level.error};
+        ok = ok && fwrite(&lh, sizeof(lh), 1, f) == 1 &&
+             fwrite(level.vertices.data(), sizeof(double),
+                    level.vertices.size(), f) == level.vertices.size() &&
+             fwrite(level.faces.data(), sizeof(int), level.faces.size(), f) ==
+                 level.faces.size() &&
+             fwrite(level.source.data(), sizeof(int), level.source.size(),
+                    f) == level.source.size();
+    }
+    ok = fclose(f) == 0 && ok;
+    if (!ok || rename(tmpFile, cacheFile) != 0) {
+        unlink(tmpFile);
+        return false;
+    }
+    return true;
+}
+
+void MeshData::loadLevels(const char *file, std::vector<MeshLevel> &levels,
+                          int minFaces) const {
+    struct stat st;
+    LevelCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, LEVEL_MAGIC, 4);
+    header.version = LEVEL_VERSION;
+    header.minFaces = minFaces;
+    char cacheFile[4096];
+    snprintf(cacheFile, sizeof(cacheFile), "%s.rlod", file);
+    const bool cacheable = stat(file, &st) == 0;
+    if (cacheable) {
+        header.sourceSize = st.st_size;
+        header.sourceMtime =
+            (long long)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+        FILE *f = fopen(cacheFile, "rb");
+        if (f) {
+            PROFILE_SCOPE("loadLevels");
+            const bool ok = readLevels(f, header, vertexCount, levels);
+            fclose(f);
+            if (ok) return;
+        }
+    }
+
+    simplify(levels, minFaces);
+    // a read-only directory just means simplifying on every load
+    if (cacheable) writeLevels(cacheFile, header, levels);
+}
@@ -0,0 +1,35 @@
+#!/bin/sh
+# More instances than SDL's int vertex indices can address must be refused
+# with an error, not overflow the frame buffers.
+#
+#   sh tests/instances.sh ./renderer-cpu
+bin=${1:-./renderer-cpu}
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+printf 'v 0 0 5\nv 1 0 5\nv 0 1 5\nf 1 2 3\n' > "$dir/triangle.obj"
+
+# a triangle takes 6 indices per instance, so this is far beyond INT_MAX
+"$bin" --headless 1 --instances 1000000000 "$dir/triangle.obj" \
+    > "$dir/out.txt" 2>&1
+status=$?
+if [ $status -ne 1 ]; then
+    cat "$dir/out.txt"
+    echo "FAIL: expected exit status 1, got $status"
+    exit 1
+fi
+if ! grep -q '^\[Error\] .* allows at most [0-9]* instances' "$dir/out.txt"; then
+    cat "$dir/out.txt"
+    echo "FAIL: no error about the instance count"
+    exit 1
+fi
+
+# and as many as fit still draw
+"$bin" --headless 1 --instances 4 "$dir/triangle.obj" > "$dir/out.txt" 2>&1
+status=$?
+if [ $status -ne 0 ]; then
+    cat "$dir/out.txt"
+    echo "FAIL: 4 instances exited with $status"
+    exit 1
+fi
+echo "PASS: instances"
@@ -0,0 +1,152 @@
+// Checks the vector kernels of kernel_simd.h against the scalar ones: every
+// vertex must come out the same wherever its range is split, as the thread
+// pool splits it anywhere, and within rounding of the scalar result, which
+// does not fuse its multiply-adds.
+//
+//   make check, or run tests/kernels after it
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <vector>
+
+#include "../kernel_simd.h"
+
+static const int COUNT = 77;
+
+static unsigned long long state = 1;
+
+// a value in [-1, 1), the same on every run
+static double uniform() {
+    state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+    return (double)(state >> 11) / (double)(1ULL << 52) - 1;
+}
+
+template <typename T> struct Kernels {
+    const char *name;
+    void (*transform)(int, int, int, const T *, const T *, const T *, float *,
+                      int, float *, float *);
+    void (*transformPoints)(int, int, int, T *, const T *);
+};
+
+// The screen x, y, depth and w planes of one GPU::transform
+struct Screen {
+    std::vector<float> xy, depth, w;
+    Screen() : xy(COUNT * 2), depth(COUNT), w(COUNT) {}
+    bool operator==(const Screen &o) const {
+        return memcmp(xy.data(), o.xy.data(), sizeof(float) * xy.size()) ==
+                   0 &&
+               memcmp(depth.data(), o.depth.data(),
+                      sizeof(float) * depth.size()) == 0 &&
+               memcmp(w.data(), o.w.data(), sizeof(float) * w.size()) == 0;
+    }
+};
+
+static bool agree(double a, double b, double tolerance) {
+    return fabs(a - b) <= tolerance * (1 + fabs(a));
+}
+
+template <typename T>
+static int check(const Kernels<T> &k, const char *type, double tolerance) {
+    std::vector<T> in(COUNT * 3);
+    for (T &v : in) v = uniform();
+    // w stays in [4, 6], well away from W_EPSILON
+    T clip[16], screen[16], mat[16];
+    for (int i = 0; i < 16; i++) {
+        clip[i] = uniform();
+        screen[i] = uniform() * 400;
+        mat[i] = uniform();
+    }
+    clip[3] = clip[7] = clip[11] = (T)0.3;
+    clip[15] = 5;
+
+    int failures = 0;
+    Screen whole, scalar;
+    k.transform(0, COUNT, COUNT, in.data(), clip, screen, whole.xy.data(), 2,
+                whole.depth.data(), whole.w.data());
+    for (int i = 0; i < COUNT; i++) {
+        transformVertex(i, COUNT, in.data(), clip, screen, scalar.xy.data(), 2,
+                        scalar.depth.data(), scalar.w.data());
+    }
+    for (int split = 0; split <= COUNT; split++) {
+        Screen parts;
+        k.transform(0, split, COUNT, in.data(), clip, screen, parts.xy.data(),
+                    2, parts.depth.data(), parts.w.data());
+        k.transform(split, COUNT, COUNT, in.data(), clip, screen,
+                    parts.xy.data(), 2, parts.depth.data(), parts.w.data());
+        if (!(parts == whole)) {
+            printf("FAIL: %s transform<%s> changes when split at %d\n",
+                   k.name, type, split);
+            failures++;
+            break;
+        }
+    }
+    for (int i = 0; i < COUNT; i++) {
+        if (!agree(whole.xy[i * 2], scalar.xy[i * 2], tolerance) ||
+            !agree(whole.xy[i * 2 + 1], scalar.xy[i * 2 + 1], tolerance) ||
+            !agree(whole.depth[i], scalar.depth[i], tolerance) ||
+            !agree(whole.w[i], scalar.w[i], tolerance)) {
+            printf("FAIL: %s transform<%s> vertex %d is (%g %g %g %g), "
+                   "scalar gives (%g %g %g %g)\n",
+                   k.name, type, i, whole.xy[i * 2], whole.xy[i * 2 + 1],
+                   whole.depth[i], whole.w[i], scalar.xy[i * 2],
+                   scalar.xy[i * 2 + 1], scalar.depth[i], scalar.w[i]);
+            failures++;
+            break;
+        }
+    }
+
+    std::vector<T> points = in, reference = in;
+    k.transformPoints(0, COUNT, COUNT, points.data(), mat);
+    for (int i = 0; i < COUNT; i++) {
+        transformPoint(i, COUNT, reference.data(), mat);
+    }
+    for (int split = 0; split <= COUNT; split++) {
+        std::vector<T> parts = in;
+        k.transformPoints(0, split, COUNT, parts.data(), mat);
+        k.transformPoints(split, COUNT, COUNT, parts.data(), mat);
+        if (parts != points) {
+            printf("FAIL: %s transformPoints<%s> changes when split at %d\n",
+                   k.name, type, split);
+            failures++;
+            break;
+        }
+    }
+    for (size_t i = 0; i < points.size(); i++) {
+        if (!agree(points[i], reference[i], tolerance)) {
+            printf("FAIL: %s transformPoints<%s> value %zu is %g, scalar "
+                   "gives %g\n",
+                   k.name, type, i, (double)points[i], (double)reference[i]);
+            failures++;
+            break;
+        }
+    }
+    return failures;
+}
+
+int main() {
+    int failures = 0, checked = 0;
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        failures += check<float>({"avx2", transformAVX2, transformPointsAVX2},
+                                 "float", 1e-5);
+        failures += check<double>({"avx2", transformAVX2, transformPointsAVX2},
+                                  "double", 1e-13);
+        checked++;
+    }
+    if (__builtin_cpu_supports("avx512f")) {
+        failures += check<float>(
+            {"avx512", transformAVX512, transformPointsAVX512}, "float", 1e-5);
+        failures += check<double>(
+            {"avx512", transformAVX512, transformPointsAVX512}, "double",
+            1e-13);
+        checked++;
+    }
+#endif
+    if (checked == 0) printf("kernels: no vector kernels on this CPU\n");
+    if (failures) return 1;
+    printf("PASS: kernels\n");
+    return 0;
+}
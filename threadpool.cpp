@@ -0,0 +1,134 @@
+#include "threadpool.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+struct Job {
+    const std::function<void(int, int)> *fn;
+    int count, chunk;
+    std::atomic<int> next;
+    std::atomic<int> remaining;
+};
+
+static std::vector<std::thread> workers;
+static std::mutex jobMutex;        // guards job, generation and stopping
+static std::mutex ownerMutex;      // held by the thread submitting a job
+static std::condition_variable jobReady, jobDone;
+static Job *job = NULL;
+static unsigned long generation = 0;
+static int busyWorkers = 0;        // workers still holding a pointer to job
+static bool stopping = false;
+// set once init() ran, a pool of one thread has no workers to tell
+static std::atomic<bool> started(false);
+static thread_local bool insideJob = false;
+
+static void runChunks(Job *j) {
+    insideJob = true;
+    int start;
+    while ((start = j->next.fetch_add(j->chunk)) < j->count) {
+        int end = start + j->chunk < j->count ? start + j->chunk : j->count;
+        (*j->fn)(start, end);
+        if (j->remaining.fetch_sub(end - start) == end - start) {
+            std::lock_guard<std::mutex> lock(jobMutex);
+            jobDone.notify_all();
+        }
+    }
+    insideJob = false;
+}
+
+static void workerLoop() {
+    unsigned long seen = 0;
+    while (true) {
+        Job *j;
+        {
+            std::unique_lock<std::mutex> lock(jobMutex);
+            jobReady.wait(lock,
+                          [&] { return stopping || generation != seen; });
+            if (stopping) return;
+            seen = generation;
+            j = job;
+            if (j) busyWorkers++;
+        }
+        if (!j) continue;
+        runChunks(j);
+        std::lock_guard<std::mutex> lock(jobMutex);
+        if (--busyWorkers == 0) jobDone.notify_all();
+    }
+}
+
+void ThreadPool::init(int threads) {
+    // a job is running, so the pool is up, and its owner holds the lock
+    if (insideJob) return;
+    std::lock_guard<std::mutex> owner(ownerMutex);
+    if (started) return;
+    if (threads <= 0) threads = std::thread::hardware_concurrency();
+    if (threads <= 0) threads = 1;
+    stopping = false;
+    // the caller is the remaining thread
+    for (int i = 1; i < threads; i++) {
+        workers.emplace_back(workerLoop);
+    }
+    started = true;
+}
+
+void ThreadPool::shutdown() {
+    std::lock_guard<std::mutex> owner(ownerMutex);
+    {
+        std::lock_guard<std::mutex> lock(jobMutex);
+        stopping = true;
+    }
+    jobReady.notify_all();
+    for (std::thread &t : workers) t.join();
+    workers.clear();
+    started = false;
+}
+
+int ThreadPool::size() { return workers.size() + 1; }
+
+void ThreadPool::parallel_for(int count, int grain,
+                              const std::function<void(int, int)> &fn) {
+    if (count <= 0) return;
+    if (!started) init();
+    if (grain < 1) grain = 1;
+
+    int threads = size();
+    if (insideJob || threads == 1 || count <= grain) {
+        fn(0, count);
+        return;
+    }
+
+    std::unique_lock<std::mutex> owner(ownerMutex, std::try_to_lock);
+    if (!owner.owns_lock()) {
+        // another thread is driving the pool, don't queue behind it
+        fn(0, count);
+        return;
+    }
+
+    // a few chunks per thread evens out uneven work
+    int chunk = (count + threads * 4 - 1) / (threads * 4);
+    if (chunk < grain) chunk = grain;
+
+    Job j;
+    j.fn = &fn;
+    j.count = count;
+    j.chunk = chunk;
+    j.next = 0;
+    j.remaining = count;
+    {
+        std::lock_guard<std::mutex> lock(jobMutex);
+        job = &j;
+        generation++;
+    }
+    jobReady.notify_all();
+
+    runChunks(&j);
+
+    std::unique_lock<std::mutex> lock(jobMutex);
+    jobDone.wait(lock, [&] {
+        return j.remaining.load() == 0 && busyWorkers == 0;
+    });
+    job = NULL;
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <functional>
+
+// A fixed set of worker threads shared by the whole renderer. Work is handed
+// out as index ranges; the calling thread takes part in the work and returns
+// only once every range has been processed.
+struct ThreadPool {
+    // Spawns the workers. threads == 0 means one per hardware thread.
+    // Calling it is optional, the first parallel_for does it implicitly.
+    static void init(int threads = 0);
+    static void shutdown();
+
+    // Number of threads (including the caller) that take part in a job.
+    static int size();
+
+    // Calls fn(begin, end) over disjoint ranges covering [0, count). Ranges
+    // hold at least grain items, so small jobs stay on the calling thread.
+    // Nested calls, and calls made while another thread owns the pool, run
+    // serially on the caller.
+    static void parallel_for(int count, int grain,
+                             const std::function<void(int, int)> &fn);
+};